@@ -2,46 +2,278 @@
 // SPDX-FileCopyrightText: 2016-2023, Knut Reinert & MPI für molekulare Genetik
 // SPDX-License-Identifier: BSD-3-Clause
 
+#include "utils/BlockReader.h"
+#include "utils/BufferedWriter.h"
+#include "utils/HitFile.h"
+#include "utils/ParallelFor.h"
+
+#include <algorithm>
+#include <array>
 #include <filesystem>
+#include <iomanip>
+#include <optional>
+#include <span>
 #include <seqan3/alphabet/nucleotide/dna5.hpp>
 #include <seqan3/argument_parser/all.hpp>
 #include <seqan3/core/debug_stream.hpp>
 #include <seqan3/io/sequence_file/all.hpp>
 #include <sstream>
+#include <utility>
 
 
-struct Reader {
-    std::ifstream ifs;
+/** reports lines of a hit file that are not hits */
+void reportInvalid(std::string_view line) {
+    std::cerr << "ignoring: " << line << "\n";
+}
 
+struct Reader {
     std::unordered_map<size_t, std::unordered_map<size_t, std::unordered_set<size_t>>> entries;
 
-    Reader(std::filesystem::path file)
-        : ifs(file)
-    {
-        while (!ifs.eof()) {
-            readEntry();
+    Reader(std::filesystem::path file, size_t threads) {
+        for (auto const& hit : readHits(file, threads, reportInvalid)) {
+            entries[hit.qid][hit.sid].insert(hit.pos);
         }
     }
+};
 
-private:
-    void readEntry() {
-    std::string line;
-    if (!std::getline(ifs, line)) return;
+/** reads a text hit file one hit at a time */
+struct HitReader {
+    BlockReader        in;
+    std::string_view   block;
+    std::optional<Hit> current;
 
-    auto s1 = line.find(' ');
-    auto s2 = line.find(' ', s1+1);
+    explicit HitReader(std::filesystem::path const& file)
+        : in{file}
+    {
+        if (isBinaryHitFile(in)) {
+            throw std::runtime_error(file.string() + " is a binary hit file, --stream expects text");
+        }
+        advance();
+    }
 
-    try {
-        auto qid  = std::stod(line.substr(0, s1));
-        auto sid  = std::stod(line.substr(s1, s2));
-        auto spos = std::stod(line.substr(s2));
-        entries[qid][sid].insert(spos);
-    } catch(std::exception const& e) {
-        std::cerr << "ignoring: " << line << "\n";
+    void advance() {
+        current.reset();
+        while (true) {
+            if (block.empty()) {
+                block = in.next();
+                if (block.empty()) return;
+            }
+            auto line = block.substr(0, block.find('\n'));
+            block.remove_prefix(std::min(block.size(), line.size() + 1));
+            auto hit = Hit{};
+            if (parseHitLine(line, hit)) {
+                current = hit;
+                return;
+            }
+            if (!line.empty()) {
+                reportInvalid(line);
+            }
+        }
     }
+
+    /** collects all consecutive hits of the given query, sorted and without duplicates */
+    void readQuery(uint64_t qid, std::vector<Hit>& hits) {
+        hits.clear();
+        while (current && current->qid == qid) {
+            hits.push_back(*current);
+            advance();
+        }
+        if (current && current->qid < qid) {
+            throw std::runtime_error("input is not sorted by query id, found " + std::to_string(current->qid) + " after " + std::to_string(qid));
+        }
+        std::ranges::sort(hits);
+        hits.erase(std::unique(hits.begin(), hits.end()), hits.end());
     }
 };
 
+/** Sorts and removes duplicates
+ *
+ * Sample sort: splitters taken from a regular sample of the hits cut
+ * them into 256 buckets of similar size, however the query ids are
+ * distributed. Every chunk of the input counts its bucket sizes and
+ * scatters its hits into its own slots of each bucket, then the buckets
+ * are sorted; all three steps run in parallel. Needs a second array of
+ * the hits plus one byte per hit while scattering, a single thread sorts
+ * in place.
+ */
+void sortHits(std::vector<Hit>& hits, size_t threads) {
+    constexpr size_t bucketCount  = 256;
+    constexpr size_t oversampling = 32;
+    if (threads <= 1 || hits.size() < bucketCount * oversampling) {
+        std::ranges::sort(hits);
+        hits.erase(std::unique(hits.begin(), hits.end()), hits.end());
+        return;
+    }
+
+    auto sample = std::vector<Hit>{};
+    auto stride = hits.size() / (bucketCount * oversampling);
+    for (size_t i{0}; i < bucketCount * oversampling; ++i) {
+        sample.push_back(hits[i * stride]);
+    }
+    std::ranges::sort(sample);
+    auto splitters = std::array<Hit, bucketCount - 1>{};
+    for (size_t b{1}; b < bucketCount; ++b) {
+        splitters[b-1] = sample[b * oversampling];
+    }
+
+    // equal hits always end up in the same bucket
+    auto chunks    = std::max<size_t>(1, threads) * 4;
+    auto chunkSize = (hits.size() + chunks - 1) / chunks;
+    auto buckets   = std::vector<uint8_t>(hits.size());
+    auto counts    = std::vector<std::array<size_t, bucketCount>>(chunks);
+    parallelFor(threads, chunks, [&](size_t c, size_t) {
+        for (auto i = c * chunkSize; i < std::min(hits.size(), (c + 1) * chunkSize); ++i) {
+            auto b     = std::ranges::upper_bound(splitters, hits[i]) - splitters.begin();
+            buckets[i] = b;
+            counts[c][b] += 1;
+        }
+    });
+
+    // counts become the write offset of every chunk into every bucket
+    auto starts = std::array<size_t, bucketCount + 1>{};
+    size_t offset{0};
+    for (size_t b{0}; b < bucketCount; ++b) {
+        starts[b] = offset;
+        for (auto& count : counts) {
+            offset += std::exchange(count[b], offset);
+        }
+    }
+    starts[bucketCount] = offset;
+
+    auto sorted = std::vector<Hit>(hits.size());
+    parallelFor(threads, chunks, [&](size_t c, size_t) {
+        auto& next = counts[c];
+        for (auto i = c * chunkSize; i < std::min(hits.size(), (c + 1) * chunkSize); ++i) {
+            sorted[next[buckets[i]]++] = hits[i];
+        }
+    });
+    hits.clear();
+    hits.shrink_to_fit();
+    buckets.clear();
+    buckets.shrink_to_fit();
+
+    parallelFor(threads, bucketCount, [&](size_t b, size_t) {
+        std::sort(sorted.begin() + starts[b], sorted.begin() + starts[b+1]);
+    });
+    sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+    hits = std::move(sorted);
+}
+
+/** Linear merge of two sorted hit lists
+ *
+ * Calls match(hit, distance) for every lhs hit, distance is the smallest
+ * position difference to an rhs hit of the same query and subject, or
+ * nullopt if there is none within the error window.
+ */
+template <typename CB>
+void matchHits(std::span<Hit const> lhs, std::span<Hit const> rhs, size_t error, CB&& match) {
+    size_t j{0};
+    for (auto const& h : lhs) {
+        auto lower = Hit{h.qid, h.sid, h.pos - std::min<uint64_t>(h.pos, error)};
+        while (j < rhs.size() && rhs[j] < lower) {
+            ++j;
+        }
+        auto distance = std::optional<uint64_t>{};
+        for (auto k = j; k < rhs.size() && rhs[k].qid == h.qid && rhs[k].sid == h.sid && rhs[k].pos <= h.pos + error; ++k) {
+            auto d = rhs[k].pos < h.pos ? h.pos - rhs[k].pos : rhs[k].pos - h.pos;
+            distance = std::min(distance.value_or(d), d);
+            if (rhs[k].pos >= h.pos) break; // further hits are only farther away
+        }
+        match(h, distance);
+    }
+}
+
+/** calls missing(hit) for every lhs hit without rhs hit within the error window */
+template <typename CB>
+void mergeCompare(std::span<Hit const> lhs, std::span<Hit const> rhs, size_t error, CB&& missing) {
+    matchHits(lhs, rhs, error, [&](Hit const& h, std::optional<uint64_t> distance) {
+        if (!distance) {
+            missing(h);
+        }
+    });
+}
+
+/** Aggregated comparison, one query at a time
+ *
+ * Side 0 are the left hits looked up on the right (recall, if the left
+ * side is the truth), side 1 the right hits looked up on the left
+ * (precision).
+ */
+struct Summary {
+    size_t error{};
+    size_t queries{};
+    std::array<size_t, 2>                  hits{};
+    std::array<size_t, 2>                  missing{};
+    std::array<size_t, 2>                  emptyQueries{};  // queries with hits only on the other side
+    std::array<std::vector<size_t>, 2>     distances;       // found hits by distance, [0, error]
+    std::array<std::array<size_t, 11>, 2>  foundRatio{};    // queries by found fraction, in steps of 10%
+
+    explicit Summary(size_t error_)
+        : error{error_}
+        , distances{std::vector<size_t>(error_ + 1), std::vector<size_t>(error_ + 1)}
+    {}
+
+    void addQuery(std::span<Hit const> lhs, std::span<Hit const> rhs) {
+        queries += 1;
+        addSide(0, lhs, rhs);
+        addSide(1, rhs, lhs);
+    }
+
+    /** both arrays sorted, calls addQuery for every query present on either side */
+    void addAll(std::span<Hit const> lhs, std::span<Hit const> rhs) {
+        while (!lhs.empty() || !rhs.empty()) {
+            auto qid = std::min(lhs.empty() ? std::numeric_limits<uint64_t>::max() : lhs.front().qid,
+                                rhs.empty() ? std::numeric_limits<uint64_t>::max() : rhs.front().qid);
+            auto take = [qid](std::span<Hit const>& hits) {
+                size_t n{0};
+                while (n < hits.size() && hits[n].qid == qid) ++n;
+                auto query = hits.first(n);
+                hits = hits.subspan(n);
+                return query;
+            };
+            auto l = take(lhs);
+            auto r = take(rhs);
+            addQuery(l, r);
+        }
+    }
+
+    void print(std::ostream& os) const {
+        auto row = [&](std::string_view label, size_t l, size_t r) {
+            os << std::left << std::setw(28) << label << std::right << std::setw(14) << l << std::setw(14) << r << "\n";
+        };
+        os << "queries: " << queries << ", error: " << error << "\n";
+        os << std::left << std::setw(28) << "" << std::right << std::setw(14) << "left" << std::setw(14) << "right" << "\n";
+        row("hits", hits[0], hits[1]);
+        row("missing on other side", missing[0], missing[1]);
+        row("queries without hits", emptyQueries[0], emptyQueries[1]);
+        for (size_t d{0}; d <= error; ++d) {
+            row("found at distance " + std::to_string(d), distances[0][d], distances[1][d]);
+        }
+        os << "queries by found fraction (left: recall, right: precision)\n";
+        for (size_t i{0}; i < 11; ++i) {
+            auto label = i < 10 ? "  " + std::to_string(i*10) + "-" + std::to_string(i*10+9) + "%" : std::string{"  100%"};
+            row(label, foundRatio[0][i], foundRatio[1][i]);
+        }
+    }
+
+private:
+    void addSide(size_t side, std::span<Hit const> lhs, std::span<Hit const> rhs) {
+        if (lhs.empty()) {
+            emptyQueries[side] += 1;
+            return;
+        }
+        size_t found{0};
+        matchHits(lhs, rhs, error, [&](Hit const&, std::optional<uint64_t> distance) {
+            if (distance) {
+                distances[side][*distance] += 1;
+                found += 1;
+            }
+        });
+        hits[side]    += lhs.size();
+        missing[side] += lhs.size() - found;
+        foundRatio[side][found * 10 / lhs.size()] += 1;
+    }
+};
 
 void f(char symb, size_t qidx, size_t sid, size_t spos) {
     std::cout << symb << " " << qidx << " " << sid << " " << spos << "\n";
@@ -62,6 +294,18 @@ int main(int argc, char const* const* argv) {
     size_t error = 0;
     parser.add_option(error, '\0', "error", "allowed variation in start positions.");
 
+    bool merge{false};
+    parser.add_flag(merge, '\0', "merge", "compare sorted flat hit arrays, needs a fraction of the memory, output is sorted");
+
+    bool stream{false};
+    parser.add_flag(stream, '\0', "stream", "both files are sorted by query id, compare one query at a time with bounded memory");
+
+    bool summary{false};
+    parser.add_flag(summary, '\0', "summary", "print counts and recall/precision histograms instead of the differing hits (implies --merge, unless --stream is given)");
+
+    size_t threads{defaultThreadCount()};
+    parser.add_option(threads, '\0', "threads", "number of threads used for parsing and (merge) sorting");
+
     try {
          parser.parse();
     } catch (seqan3::argument_parser_error const& ext) {
@@ -70,8 +314,75 @@ int main(int argc, char const* const* argv) {
     }
 
 
-    auto lhs = Reader(lhs_file);
-    auto rhs = Reader(rhs_file);
+    auto out   = BufferedWriter{};
+    auto print = [&](char symb) {
+        return [&out, symb](Hit const& h) {
+            out.put(symb);
+            out.put(' ');
+            out.writeInt(h.qid);
+            out.put(' ');
+            out.writeInt(h.sid);
+            out.put(' ');
+            out.writeInt(h.pos);
+            out.put('\n');
+        };
+    };
+
+    // the histograms are only allocated if they are printed
+    auto report = std::optional<Summary>{};
+    if (summary) {
+        report.emplace(error);
+    }
+
+    if (stream) {
+        // differences are reported per query, first the left then the right side
+        try {
+            auto lhs  = HitReader{lhs_file};
+            auto rhs  = HitReader{rhs_file};
+            auto lhsQ = std::vector<Hit>{};
+            auto rhsQ = std::vector<Hit>{};
+            while (lhs.current || rhs.current) {
+                auto qid = std::min(lhs.current ? lhs.current->qid : std::numeric_limits<uint64_t>::max(),
+                                    rhs.current ? rhs.current->qid : std::numeric_limits<uint64_t>::max());
+                lhs.readQuery(qid, lhsQ);
+                rhs.readQuery(qid, rhsQ);
+                if (report) {
+                    report->addQuery(lhsQ, rhsQ);
+                    continue;
+                }
+                mergeCompare(lhsQ, rhsQ, error, print('<'));
+                mergeCompare(rhsQ, lhsQ, error, print('>'));
+            }
+        } catch (std::exception const& e) {
+            out.flush();
+            std::cerr << e.what() << "\n";
+            return EXIT_FAILURE;
+        }
+        if (report) {
+            report->print(std::cout);
+        }
+        return EXIT_SUCCESS;
+    }
+
+    if (merge || summary) {
+        auto lhs = readHits(lhs_file, threads, reportInvalid);
+        auto rhs = readHits(rhs_file, threads, reportInvalid);
+        std::cerr << "done reading\n" << std::flush;
+        sortHits(lhs, threads);
+        sortHits(rhs, threads);
+
+        if (report) {
+            report->addAll(lhs, rhs);
+            report->print(std::cout);
+            return EXIT_SUCCESS;
+        }
+        mergeCompare(lhs, rhs, error, print('<'));
+        mergeCompare(rhs, lhs, error, print('>'));
+        return EXIT_SUCCESS;
+    }
+
+    auto lhs = Reader(lhs_file, threads);
+    auto rhs = Reader(rhs_file, threads);
 
     std::cerr << "done reading\n" << std::flush;
 
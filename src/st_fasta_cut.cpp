@@ -2,7 +2,11 @@
 // SPDX-FileCopyrightText: 2016-2023, Knut Reinert & MPI für molekulare Genetik
 // SPDX-License-Identifier: BSD-3-Clause
 
+#include "utils/FastaIndex.h"
+#include "utils/MappedFile.h"
+
 #include <filesystem>
+#include <fstream>
 #include <seqan3/alphabet/nucleotide/dna5.hpp>
 #include <seqan3/argument_parser/all.hpp>
 #include <seqan3/core/debug_stream.hpp>
@@ -43,7 +47,23 @@ int main(int argc, char const* const* argv) {
     }
 
 
-    seqan3::sequence_file_input fin{infile};
+    // jump directly to the first record that is not skipped
+    auto ifs = std::ifstream{infile, std::ios::binary};
+    if (skipChr > 0) {
+        try {
+            auto text  = MappedFile{infile};
+            auto index = FastaIndex::loadOrBuild(infile, text.view());
+            if (skipChr >= index.entries.size()) {
+                return EXIT_SUCCESS;
+            }
+            ifs.seekg(FastaIndex::recordBegin(text.view(), index.entries[skipChr]));
+            skipChr = 0;
+        } catch (std::exception const& e) {
+            seqan3::debug_stream << e.what() << ", falling back to sequential scan\n";
+        }
+    }
+
+    seqan3::sequence_file_input fin{ifs, seqan3::format_fasta{}};
     seqan3::sequence_file_output fout{std::cout, seqan3::format_fasta{}};
     fout.options.fasta_blank_before_id = false;
     uint64_t ctBases{0};
@@ -2,13 +2,118 @@
 // SPDX-FileCopyrightText: 2016-2023, Knut Reinert & MPI für molekulare Genetik
 // SPDX-License-Identifier: BSD-3-Clause
 
+#include "utils/BufferedWriter.h"
+#include "utils/MappedFile.h"
+#include "utils/RecordTable.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstring>
 #include <filesystem>
+#include <fstream>
+#include <seqan3/alphabet/nucleotide/dna15.hpp>
 #include <seqan3/alphabet/nucleotide/dna5.hpp>
 #include <seqan3/argument_parser/all.hpp>
 #include <seqan3/core/debug_stream.hpp>
 #include <seqan3/io/sequence_file/all.hpp>
 #include <sstream>
 
+/** Walks the sequence lines of a fasta file
+ *
+ * The input is not parsed into records, onRecord(id) is called for every
+ * header line and onLine(line) for every sequence line (without newline).
+ */
+template <typename CB1, typename CB2>
+void forEachSequenceLine(std::string_view data, CB1&& onRecord, CB2&& onLine) {
+    bool inRecord = false;
+    while (!data.empty()) {
+        auto eolPtr = static_cast<char const*>(std::memchr(data.data(), '\n', data.size()));
+        auto line   = data.substr(0, eolPtr ? eolPtr - data.data() : data.size());
+        data.remove_prefix(std::min(data.size(), line.size() + 1));
+
+        if (!line.empty() && line[0] == '>') {
+            auto id = line.substr(std::min(line.size(), line.find_first_not_of(" \t", 1)));
+            if (!id.empty() && id.back() == '\r') id.remove_suffix(1);
+            onRecord(id);
+            inRecord = true;
+        } else if (inRecord) {
+            onLine(line);
+        }
+    }
+}
+
+/** Writes a file of known size back to front
+ *
+ * Same interface as BufferedWriter. Every flushed block is reversed and
+ * written to its mirrored position, so the file ends up byte-wise reversed
+ * (what st_binary_rev does) without a second pass.
+ */
+struct ReverseFileWriter {
+    int               fd{-1};
+    size_t            remaining{};
+    std::vector<char> buffer;
+    size_t            used{};
+
+    ReverseFileWriter(std::filesystem::path const& file, size_t totalSize, size_t capacity = 1ul << 22)
+        : fd{::open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644)}
+        , remaining{totalSize}
+        , buffer(capacity)
+    {
+        if (fd == -1 || ::ftruncate(fd, totalSize) != 0) {
+            throw std::runtime_error("can not open " + file.string() + " for writing");
+        }
+    }
+    ReverseFileWriter(ReverseFileWriter const&) = delete;
+    auto operator=(ReverseFileWriter const&) -> ReverseFileWriter& = delete;
+    ~ReverseFileWriter() {
+        try {
+            flush();
+        } catch (...) {}
+        ::close(fd);
+    }
+
+    void flush() {
+        if (used > remaining) {
+            throw std::runtime_error("output is larger than expected");
+        }
+        std::reverse(buffer.begin(), buffer.begin() + used);
+        remaining -= used;
+        auto p   = buffer.data();
+        auto pos = static_cast<off_t>(remaining);
+        while (used > 0) {
+            auto r = ::pwrite(fd, p, used, pos);
+            if (r < 0) {
+                if (errno == EINTR) continue;
+                throw std::runtime_error("failed writing output");
+            }
+            p    += r;
+            pos  += r;
+            used -= r;
+        }
+    }
+
+    auto reserve(size_t n) -> char* {
+        if (buffer.size() - used < n) {
+            flush();
+            if (buffer.size() < n) {
+                buffer.resize(n);
+            }
+        }
+        return buffer.data() + used;
+    }
+
+    void commit(size_t n) {
+        used += n;
+    }
+
+    void write(std::string_view s) {
+        auto p = reserve(s.size());
+        std::copy(s.begin(), s.end(), p);
+        commit(s.size());
+    }
+};
+
 int main(int argc, char const* const* argv) {
     seqan3::argument_parser parser{"st_fasta_dump", argc, argv};
 
@@ -23,29 +128,142 @@ int main(int argc, char const* const* argv) {
     parser.add_option(delimiter,     'd', "delimiter", "Delimiter between sequences");
     parser.add_option(end_delimiter, 'e', "end_delimiter", "Delimiter at the end of all sequences");
 
+    std::string mapping;
+    parser.add_option(mapping, 'm', "map", "Map every character to its rank in this string, e.g.: \"$ACGT\" (as st_text_map does)");
+
+    bool reverse{false};
+    parser.add_flag(reverse, 'r', "reverse", "write the text byte-wise reversed (as st_binary_rev does), requires --output");
+
+    std::filesystem::path outfile{};
+    parser.add_option(outfile, 'o', "output", "write to this file instead of stdout");
+
+    std::filesystem::path positionsFile{};
+    parser.add_option(positionsFile, 'p', "positions", "write the start positions of all sequences, as st_multistring_filter expects them in <fasta>.pos");
+
+    std::filesystem::path recordsFile{};
+    parser.add_option(recordsFile, '\0', "records", "write a binary table with start, length and name of every sequence in the dumped text (with --reverse the starts refer to the reversed text)");
+
     try {
          parser.parse();
+         if (reverse && outfile.empty()) {
+             throw seqan3::argument_parser_error{"--reverse requires --output"};
+         }
     } catch (seqan3::argument_parser_error const& ext) {
         seqan3::debug_stream << "Parsing error. " << ext.what() << "\n";
         return EXIT_FAILURE;
     }
 
-    // conversion from dna5 to dna4
-    seqan3::sequence_file_input fin{infile};
+    // raw characters normalized the same way seqan3::dna5 does it and optionally mapped to a rank
+    // keep marks characters that are written, whitespace and digits are skipped
+    // invalid marks characters that seqan3's fasta reader rejects for dna5 (everything outside of dna15)
+    auto rankMap = std::array<char, 256>{};
+    for (size_t i{0}; i < 256; ++i) {
+        rankMap[i] = mapping.empty() ? static_cast<char>(i) : 0;
+    }
+    for (size_t i{0}; i < mapping.size(); ++i) {
+        rankMap[static_cast<uint8_t>(mapping[i])] = i;
+    }
+    auto table   = std::array<char, 256>{};
+    auto keep    = std::array<uint8_t, 256>{};
+    auto invalid = std::array<uint8_t, 256>{};
+    for (size_t i{0}; i < table.size(); ++i) {
+        if (std::isspace(static_cast<int>(i)) || std::isdigit(static_cast<int>(i))) continue;
+        auto c     = seqan3::assign_char_to(static_cast<char>(i), seqan3::dna5{}).to_char();
+        table[i]   = rankMap[static_cast<uint8_t>(c)];
+        keep[i]    = 1;
+        invalid[i] = !seqan3::char_is_valid_for<seqan3::dna15>(static_cast<char>(i));
+    }
+    for (auto& c : delimiter) {
+        c = rankMap[static_cast<uint8_t>(c)];
+    }
+    for (auto& c : end_delimiter) {
+        c = rankMap[static_cast<uint8_t>(c)];
+    }
+
+    auto text = MappedFile{infile};
+    text.adviseSequential();
+
+    auto records = RecordTable{};
+    auto dump = [&](auto& out) {
+        bool   first = true;
+        size_t outPos{};
+        size_t start{};
+        auto   id = std::string_view{};
+        forEachSequenceLine(text.view(), [&](std::string_view nextId) {
+            if (first) {
+                first = false;
+            } else {
+                records.add(start, outPos - start, id);
+                out.write(delimiter);
+                outPos += delimiter.size();
+            }
+            start = outPos;
+            id    = nextId;
+        }, [&](std::string_view line) {
+            auto p   = out.reserve(line.size());
+            auto q   = p;
+            auto bad = uint8_t{};
+            for (auto c : line) {
+                *q   = table[static_cast<uint8_t>(c)];
+                q   += keep[static_cast<uint8_t>(c)];
+                bad |= invalid[static_cast<uint8_t>(c)];
+            }
+            if (bad) {
+                throw std::runtime_error("invalid character in sequence " + std::string{id});
+            }
+            out.commit(q - p);
+            outPos += q - p;
+        });
+        if (!first) {
+            records.add(start, outPos - start, id);
+        }
+        out.write(end_delimiter);
+    };
 
-    // iterate through all sequences in input file
-    bool first = true;
-    for (auto & record : fin) {
-        if (first) {
-            first = false;
+    try {
+        if (reverse) {
+            // the output size is needed in advance to place the reversed blocks
+            size_t sequences{}, totalSize{};
+            forEachSequenceLine(text.view(), [&](std::string_view) {
+                sequences += 1;
+            }, [&](std::string_view line) {
+                for (auto c : line) {
+                    totalSize += keep[static_cast<uint8_t>(c)];
+                }
+            });
+            totalSize += (sequences > 0 ? (sequences - 1) * delimiter.size() : 0) + end_delimiter.size();
+            {
+                auto out = ReverseFileWriter{outfile, totalSize};
+                dump(out);
+            }
+            // the records were collected in reading order, mirror them into the reversed text
+            for (size_t i{0}; i < records.size(); ++i) {
+                records.starts[i] = totalSize - records.starts[i] - records.lengths[i];
+            }
+        } else if (!outfile.empty()) {
+            auto out = BufferedWriter{outfile};
+            dump(out);
         } else {
-            std::cout << delimiter;
+            auto out = BufferedWriter{};
+            dump(out);
+        }
+
+        if (!positionsFile.empty()) {
+            auto ofs = std::ofstream{positionsFile};
+            for (auto pos : records.positions()) {
+                ofs << pos << "\n";
+            }
+            if (!ofs.flush()) {
+                throw std::runtime_error("failed writing " + positionsFile.string());
+            }
         }
-        for (auto c : record.sequence()) {
-            std::cout << seqan3::to_char(c);
+        if (!recordsFile.empty()) {
+            records.save(recordsFile);
         }
+    } catch (std::runtime_error const& e) {
+        seqan3::debug_stream << e.what() << "\n";
+        return EXIT_FAILURE;
     }
-    std::cout << end_delimiter;
 
     return EXIT_SUCCESS;
 }
@@ -2,7 +2,13 @@
 // SPDX-FileCopyrightText: 2016-2023, Knut Reinert & MPI für molekulare Genetik
 // SPDX-License-Identifier: BSD-3-Clause
 
+#include "utils/FastaIndex.h"
+#include "utils/Json.h"
+#include "utils/MappedFile.h"
+#include "utils/ParallelFor.h"
+
 #include <filesystem>
+#include <fstream>
 #include <seqan3/alphabet/views/all.hpp>
 #include <seqan3/alphabet/nucleotide/dna5.hpp>
 #include <seqan3/argument_parser/all.hpp>
@@ -10,6 +16,349 @@
 #include <seqan3/io/sequence_file/all.hpp>
 #include <sstream>
 
+// raw fasta characters normalized the same way seqan3::dna5 does it, plus their complements
+auto const dna5Chars = []() {
+    auto table = std::array<char, 256>{};
+    for (size_t i{0}; i < table.size(); ++i) {
+        table[i] = seqan3::assign_char_to(static_cast<char>(i), seqan3::dna5{}).to_char();
+    }
+    return table;
+}();
+auto const dna5Complement = []() {
+    auto table = std::array<char, 256>{};
+    for (size_t i{0}; i < table.size(); ++i) {
+        table[i] = seqan3::complement(seqan3::assign_char_to(static_cast<char>(i), seqan3::dna5{})).to_char();
+    }
+    return table;
+}();
+
+/** appends [pos, pos+len) of the entry to 'out', positions past the end are written as '_' */
+void appendRegion(std::string& out, std::string_view text, FastaIndex::Entry const& entry, size_t pos, size_t len, bool reverseComplement) {
+    auto start = out.size();
+    if (!reverseComplement) {
+        FastaIndex::fetch(text, entry, pos, len, out);
+        for (size_t i{start}; i < out.size(); ++i) {
+            out[i] = dna5Chars[static_cast<uint8_t>(out[i])];
+        }
+    } else if (pos < entry.length) {
+        // position j of the reverse complement is position length-1-j of the original sequence
+        auto end = std::min<size_t>(entry.length, pos + len);
+        FastaIndex::fetch(text, entry, entry.length - end, end - pos, out);
+        std::reverse(out.begin() + start, out.end());
+        for (size_t i{start}; i < out.size(); ++i) {
+            out[i] = dna5Complement[static_cast<uint8_t>(out[i])];
+        }
+    }
+    out.append(len - (out.size() - start), '_');
+}
+
+void viewSequential(std::filesystem::path const& infile, size_t queryId, std::string const& qname, size_t pos, size_t len, bool revCompl) {
+    seqan3::sequence_file_input fin{infile};
+    size_t i{};
+    for (auto & record : fin) {
+        if (qname.empty()) {
+            if (!revCompl) if (i++ != queryId) continue;
+            if (revCompl) if (i != queryId and i+1 != queryId) { i+=2; continue; }
+        } else {
+            if (record.id() != qname) continue;
+        }
+
+        auto seq = record.sequence();
+        if (revCompl and (queryId%2 != 0)) {
+            seq = seq | std::views::reverse | seqan3::views::complement | seqan3::ranges::to<std::vector>();
+        }
+
+        for (size_t j{pos}; j < pos+len; ++j) {
+            if (j >= seq.size()) std::cout << "_";
+            else std::cout << seq[j].to_char();
+        }
+        std::cout << "\n";
+        break;
+    }
+}
+
+struct Region {
+    FastaIndex::Entry const* entry{};
+    size_t start{};
+    size_t len{};
+    size_t order{};
+};
+
+/** Reads 'name start end' lines (BED like, 0-based, end exclusive) and prints one line per region
+ *
+ * Regions are processed in chunks. Each chunk is sorted by file offset, so the
+ * mapped fasta file is read front to back, and printed in input order.
+ */
+void viewBatch(std::istream& in, std::string_view text, FastaIndex const& index) {
+    constexpr size_t chunkSize = 1'000'000;
+
+    auto regions = std::vector<Region>{};
+    auto results = std::vector<std::string>{};
+    auto out     = std::string{};
+
+    auto flush = [&]() {
+        std::ranges::sort(regions, [](Region const& lhs, Region const& rhs) {
+            if (!lhs.entry || !rhs.entry) return !lhs.entry && rhs.entry;
+            return FastaIndex::fileOffset(*lhs.entry, lhs.start) < FastaIndex::fileOffset(*rhs.entry, rhs.start);
+        });
+        results.resize(regions.size());
+        for (auto const& r : regions) {
+            results[r.order].clear();
+            if (r.entry) {
+                appendRegion(results[r.order], text, *r.entry, r.start, r.len, false);
+            }
+        }
+        for (auto const& r : results) {
+            out += r;
+            out += '\n';
+        }
+        std::cout.write(out.data(), out.size());
+        out.clear();
+        regions.clear();
+    };
+
+    for (std::string line; std::getline(in, line);) {
+        auto lv = std::string_view{line};
+        if (lv.empty() || lv[0] == '#' || lv.starts_with("track") || lv.starts_with("browser")) continue;
+
+        auto region  = Region{};
+        region.order = regions.size();
+
+        auto nameEnd = lv.find_first_of(" \t");
+        auto fields  = std::array<size_t, 2>{};
+        auto p       = lv.data() + std::min(nameEnd, lv.size());
+        auto end     = lv.data() + lv.size();
+        bool valid   = nameEnd != std::string_view::npos;
+        for (auto& f : fields) {
+            while (p < end && (*p == ' ' || *p == '\t')) ++p;
+            auto [ptr, ec] = std::from_chars(p, end, f);
+            valid = valid && ec == std::errc{};
+            p = ptr;
+        }
+        if (valid && fields[0] <= fields[1]) {
+            region.entry = index.find(lv.substr(0, nameEnd));
+            region.start = fields[0];
+            region.len   = fields[1] - fields[0];
+        }
+        if (!region.entry) {
+            seqan3::debug_stream << "ignoring region: " << line << "\n";
+        }
+        regions.push_back(region);
+        if (regions.size() == chunkSize) {
+            flush();
+        }
+    }
+    flush();
+}
+
+/** Counts of one record, or one piece of a record, for the stats mode
+ *
+ * Newlines do not interrupt a run of Ns. leadN/trailN are the lengths of
+ * the N runs touching the beginning/end, needed to join runs across pieces.
+ */
+struct BaseStats {
+    std::array<uint64_t, 6> counts{}; // A, C, G, T, N, other (case insensitive)
+    uint64_t bases{};
+    uint64_t nRuns{};
+    uint64_t maxN{};
+    uint64_t leadN{};
+    uint64_t trailN{};
+
+    static constexpr auto symbols = std::array<char const*, 6>{"A", "C", "G", "T", "N", "other"};
+
+    auto gc() const -> double {
+        auto acgt = counts[0] + counts[1] + counts[2] + counts[3];
+        return acgt == 0 ? 0. : double(counts[1] + counts[2]) / acgt;
+    }
+
+    static auto count(std::string_view data) -> BaseStats {
+        // four interleaved histograms avoid stalls on repeated increments of the same counter
+        auto hist = std::array<std::array<uint64_t, 256>, 4>{};
+        size_t i{0};
+        for (; i + 4 <= data.size(); i += 4) {
+            ++hist[0][static_cast<uint8_t>(data[i])];
+            ++hist[1][static_cast<uint8_t>(data[i+1])];
+            ++hist[2][static_cast<uint8_t>(data[i+2])];
+            ++hist[3][static_cast<uint8_t>(data[i+3])];
+        }
+        for (; i < data.size(); ++i) {
+            ++hist[0][static_cast<uint8_t>(data[i])];
+        }
+
+        auto stats = BaseStats{};
+        for (size_t c{0}; c < 256; ++c) {
+            auto ct = hist[0][c] + hist[1][c] + hist[2][c] + hist[3][c];
+            switch (c) {
+            case '\n': case '\r': continue;
+            case 'A': case 'a': stats.counts[0] += ct; break;
+            case 'C': case 'c': stats.counts[1] += ct; break;
+            case 'G': case 'g': stats.counts[2] += ct; break;
+            case 'T': case 't': stats.counts[3] += ct; break;
+            case 'N': case 'n': stats.counts[4] += ct; break;
+            default:            stats.counts[5] += ct; break;
+            }
+            stats.bases += ct;
+        }
+        if (stats.counts[4] == 0) return stats;
+
+        uint64_t run{0};
+        bool leading{true};
+        for (auto c : data) {
+            if (c == '\n' || c == '\r') continue;
+            if (c == 'N' || c == 'n') {
+                if (run == 0) stats.nRuns += 1;
+                run += 1;
+                continue;
+            }
+            if (leading) stats.leadN = run;
+            leading    = false;
+            stats.maxN = std::max(stats.maxN, run);
+            run        = 0;
+        }
+        if (leading) stats.leadN = run;
+        stats.trailN = run;
+        stats.maxN   = std::max(stats.maxN, run);
+        return stats;
+    }
+
+    /** appends the stats of the directly following piece of the same record */
+    void append(BaseStats const& next) {
+        if (next.bases == 0) return;
+        for (size_t i{0}; i < counts.size(); ++i) {
+            counts[i] += next.counts[i];
+        }
+        nRuns += next.nRuns;
+        maxN   = std::max(maxN, next.maxN);
+        if (trailN > 0 && next.leadN > 0) { // run continues over the piece boundary
+            nRuns -= 1;
+            maxN   = std::max(maxN, trailN + next.leadN);
+        }
+        if (bases == 0) leadN = next.leadN;
+        else if (leadN == bases && next.leadN > 0) leadN += next.leadN;
+        trailN = (next.leadN == next.bases) ? trailN + next.bases : next.trailN;
+        bases += next.bases;
+    }
+};
+
+/** One parallel pass over the memory mapped file: per record base composition, GC content, N runs and N50 */
+void printStats(std::filesystem::path const& infile, size_t threads, std::filesystem::path const& jsonFile) {
+    auto text = MappedFile{infile};
+
+    // byte range [begin, end) of the sequence lines of every record
+    struct Span {
+        std::string name;
+        uint64_t    begin{};
+        uint64_t    end{};
+    };
+    auto spans = std::vector<Span>{};
+    try {
+        auto index = FastaIndex::loadOrBuild(infile, text.view());
+        for (size_t i{0}; i < index.entries.size(); ++i) {
+            auto const& e  = index.entries[i];
+            auto end = (i+1 < index.entries.size()) ? FastaIndex::recordBegin(text.view(), index.entries[i+1]) : text.size();
+            spans.push_back({e.name, std::min<uint64_t>(e.offset, end), end});
+        }
+    } catch (std::exception const&) {
+        spans.clear();
+        scanFasta(text.view(), [&](FastaRecordInfo const& info) {
+            spans.push_back({std::string{FastaIndex::shortName(info.header)}, info.offset, info.end});
+        });
+    }
+
+    // split large records into pieces, so all threads have work
+    constexpr uint64_t pieceSize = 16ul << 20;
+    struct Piece {
+        size_t    record{};
+        uint64_t  begin{};
+        uint64_t  end{};
+        BaseStats stats{};
+    };
+    auto pieces = std::vector<Piece>{};
+    for (size_t i{0}; i < spans.size(); ++i) {
+        for (auto b = spans[i].begin; b < spans[i].end; b += pieceSize) {
+            pieces.push_back({i, b, std::min(b + pieceSize, spans[i].end), {}});
+        }
+    }
+    parallelFor(threads, pieces.size(), [&](size_t i, size_t) {
+        auto& p = pieces[i];
+        p.stats = BaseStats::count(text.view().substr(p.begin, p.end - p.begin));
+    });
+
+    // pieces are ordered, merge them per record and over all records
+    auto records = std::vector<BaseStats>(spans.size());
+    for (auto const& p : pieces) {
+        records[p.record].append(p.stats);
+    }
+    auto total   = BaseStats{};
+    auto lengths = std::vector<uint64_t>{};
+    for (auto const& r : records) {
+        for (size_t i{0}; i < r.counts.size(); ++i) {
+            total.counts[i] += r.counts[i];
+        }
+        total.bases += r.bases;
+        total.nRuns += r.nRuns;
+        total.maxN   = std::max(total.maxN, r.maxN);
+        lengths.push_back(r.bases);
+    }
+    std::ranges::sort(lengths, std::greater{});
+    uint64_t n50{}, l50{}, acc{};
+    for (auto l : lengths) {
+        acc += l;
+        l50 += 1;
+        if (acc * 2 >= total.bases) {
+            n50 = l;
+            break;
+        }
+    }
+
+    auto out = std::stringstream{};
+    out << "records:     " << records.size() << "\n"
+        << "bases:       " << total.bases << "\n";
+    if (!lengths.empty()) {
+        out << "min length:  " << lengths.back() << "\n"
+            << "max length:  " << lengths.front() << "\n"
+            << "mean length: " << double(total.bases) / lengths.size() << "\n";
+    }
+    out << "N50:         " << n50 << " (L50: " << l50 << ")\n"
+        << "GC content:  " << total.gc() * 100. << "%\n"
+        << "composition:";
+    for (size_t i{0}; i < total.counts.size(); ++i) {
+        out << " " << BaseStats::symbols[i] << "=" << total.counts[i];
+    }
+    out << "\n"
+        << "N runs:      " << total.nRuns << " (longest: " << total.maxN << ")\n";
+    std::cout << out.str();
+
+    if (jsonFile.empty()) return;
+    auto json = std::ofstream{jsonFile};
+    json << "{\n"
+         << "  \"records\": " << records.size() << ",\n"
+         << "  \"bases\": " << total.bases << ",\n"
+         << "  \"n50\": " << n50 << ",\n"
+         << "  \"l50\": " << l50 << ",\n"
+         << "  \"gc\": " << total.gc() << ",\n"
+         << "  \"n_runs\": " << total.nRuns << ",\n"
+         << "  \"longest_n_run\": " << total.maxN << ",\n"
+         << "  \"composition\": {";
+    for (size_t i{0}; i < total.counts.size(); ++i) {
+        json << (i ? ", " : "") << "\"" << BaseStats::symbols[i] << "\": " << total.counts[i];
+    }
+    json << "},\n"
+         << "  \"per_record\": [";
+    for (size_t r{0}; r < records.size(); ++r) {
+        auto const& s = records[r];
+        json << (r ? ",\n" : "\n") << "    {\"name\": " << jsonString(spans[r].name)
+             << ", \"length\": " << s.bases
+             << ", \"gc\": " << s.gc()
+             << ", \"n_runs\": " << s.nRuns;
+        for (size_t i{0}; i < s.counts.size(); ++i) {
+            json << ", \"" << BaseStats::symbols[i] << "\": " << s.counts[i];
+        }
+        json << "}";
+    }
+    json << "\n  ]\n}\n";
+}
+
 int main(int argc, char const* const* argv) {
     seqan3::argument_parser parser{"st_fasta_info", argc, argv};
 
@@ -21,7 +370,7 @@ int main(int argc, char const* const* argv) {
                                  seqan3::input_file_validator{{"fa", "fasta", "fna"}});
 
     std::string mode{"unknown"};
-    parser.add_positional_option(mode, "Please provide a mode: names, lengths, view");
+    parser.add_positional_option(mode, "Please provide a mode: names, lengths, view, batch, stats");
 
     size_t queryId{}, pos{}, len{100};
     bool revCompl{false};
@@ -33,6 +382,14 @@ int main(int argc, char const* const* argv) {
     parser.add_option(len,     '\0', "len",       "(view) how many chars to print");
     parser.add_flag(revCompl,  '\0', "rev-compl", "(view) consider artificial revComple (uneven numbers are artificial)");
 
+    std::string regionsFile{"-"};
+    parser.add_option(regionsFile, '\0', "regions", "(batch) file with 'name start end' per line, '-' reads from stdin");
+
+    size_t threads{defaultThreadCount()};
+    std::filesystem::path jsonFile{};
+    parser.add_option(threads,  '\0', "threads", "(stats) number of threads");
+    parser.add_option(jsonFile, '\0', "json",    "(stats) additionally write the statistics as json to this file");
+
 
     try {
          parser.parse();
@@ -42,38 +399,94 @@ int main(int argc, char const* const* argv) {
     }
 
 
-    seqan3::sequence_file_input fin{infile};
     if (mode == "lengths") {
-        for (auto & record : fin) {
-            std::cout << record.sequence().size() << "\n";
+        // lengths are taken from the .fai index, only files that can't be indexed are scanned each time
+        auto text = MappedFile{infile};
+        auto out  = std::string{};
+        try {
+            auto index = FastaIndex::loadOrBuild(infile, text.view());
+            for (auto const& e : index.entries) {
+                out += std::to_string(e.length);
+                out += '\n';
+            }
+        } catch (std::exception const&) {
+            text.adviseSequential();
+            scanFasta(text.view(), [&](FastaRecordInfo const& info) {
+                out += std::to_string(info.length);
+                out += '\n';
+            });
         }
+        std::cout << out;
     } else if (mode == "names") {
-        for (auto & record : fin) {
-            std::cout << record.id() << "\n";
+        // names are cached in "<fasta>.map", the same file st_name_id_mapper uses
+        auto mapFile = std::filesystem::path{infile.string() + ".map"};
+        if (isCacheUpToDate(mapFile, infile)) {
+            auto ifs = std::ifstream{mapFile, std::ios::binary};
+            std::cout << ifs.rdbuf();
+        } else {
+            auto text = MappedFile{infile};
+            text.adviseSequential();
+            auto out = std::string{};
+            scanFasta(text.view(), [&](FastaRecordInfo const& info) {
+                out += info.header;
+                out += '\n';
+            });
+            auto ofs = std::ofstream{mapFile, std::ios::binary};
+            ofs.write(out.data(), out.size());
+            std::cout << out;
         }
     } else if (mode == "view") {
-        size_t i{};
-        for (auto & record : fin) {
-            if (qname.empty()) {
-                if (!revCompl) if (i++ != queryId) continue;
-                if (revCompl) if (i != queryId and i+1 != queryId) { i+=2; continue; }
-            } else {
-                if (record.id() != qname) continue;
-            }
+        auto text  = MappedFile{};
+        auto index = FastaIndex{};
+        try {
+            text = MappedFile{infile};
+        } catch (std::exception const& e) {
+            seqan3::debug_stream << e.what() << "\n";
+            return EXIT_FAILURE;
+        }
+        try {
+            index = FastaIndex::loadOrBuild(infile, text.view());
+        } catch (std::exception const& e) {
+            seqan3::debug_stream << e.what() << ", falling back to sequential scan\n";
+            viewSequential(infile, queryId, qname, pos, len, revCompl);
+            return EXIT_SUCCESS;
+        }
 
-            auto seq = record.sequence();
-            if (revCompl and (queryId%2 != 0)) {
-                seq = seq | std::views::reverse | seqan3::views::complement | seqan3::ranges::to<std::vector>();
-            }
+        auto entry = [&]() -> FastaIndex::Entry const* {
+            if (!qname.empty()) return index.find(qname);
+            auto idx = revCompl ? queryId / 2 : queryId;
+            if (idx >= index.entries.size()) return nullptr;
+            return &index.entries[idx];
+        }();
+        if (entry) {
+            auto out = std::string{};
+            appendRegion(out, text.view(), *entry, pos, len, revCompl and (queryId%2 != 0));
+            out += '\n';
+            std::cout << out;
+        }
 
-            for (size_t j{pos}; j < pos+len; ++j) {
-                if (j >= seq.size()) std::cout << "_";
-                else std::cout << seq[j].to_char();
+    } else if (mode == "batch") {
+        auto text  = MappedFile{};
+        auto index = FastaIndex{};
+        try {
+            text  = MappedFile{infile};
+            index = FastaIndex::loadOrBuild(infile, text.view());
+        } catch (std::exception const& e) {
+            seqan3::debug_stream << e.what() << "\n";
+            return EXIT_FAILURE;
+        }
+        if (regionsFile == "-") {
+            viewBatch(std::cin, text.view(), index);
+        } else {
+            auto ifs = std::ifstream{regionsFile};
+            if (!ifs.is_open()) {
+                seqan3::debug_stream << "can not open regions file " << regionsFile << "\n";
+                return EXIT_FAILURE;
             }
-            std::cout << "\n";
-            break;
+            viewBatch(ifs, text.view(), index);
         }
-
+    } else if (mode == "stats") {
+        printStats(infile, threads, jsonFile);
     } else {
         std::cout << "unknown mode: " << mode << "\n";
     }
@@ -3,6 +3,7 @@
 // SPDX-License-Identifier: BSD-3-Clause
 
 #include "oss/generator/all.h"
+#include "utils/HitFile.h"
 
 #include <ranges>
 #include <seqan3/alphabet/adaptation/char.hpp>
@@ -50,7 +51,7 @@ struct my_dna5 : seqan3::sequence_file_input_default_traits_dna {
 
 
 template <typename trait>
-void search_index(std::filesystem::path indexfile, std::filesystem::path queriesfile, std::filesystem::path resultfile, uint8_t errors) {
+void search_index(std::filesystem::path indexfile, std::filesystem::path queriesfile, std::filesystem::path resultfile, uint8_t errors, bool binary) {
     using alphabet = typename trait::sequence_alphabet;
 
     using Index = decltype(seqan3::bi_fm_index{std::vector<std::vector<alphabet>>{}});
@@ -88,19 +89,24 @@ void search_index(std::filesystem::path indexfile, std::filesystem::path queries
                                       | seqan3::search_cfg::max_error_insertion{seqan3::search_cfg::error_count{errors}}
                                       | seqan3::search_cfg::max_error_deletion{seqan3::search_cfg::error_count{errors}};
     auto result = search(queries, index, cfg);
-    auto result_2 = std::vector<std::tuple<int, int, int>>{};
+    auto result_2 = std::vector<Hit>{};
     for (auto r : result) {
         auto qid = r.query_id();
         auto sid = r.reference_id();
         auto pos = r.reference_begin_position();
-        result_2.emplace_back(qid, sid, pos);
+        result_2.push_back({qid, sid, pos});
     }
     auto delta = sw.reset();
     seqan3::debug_stream << "found " << result_2.size() << " hits in " << delta << "s which is in avg " << delta / queries.size() * 1'000'000 << "μs per query\n";
-    auto ofs = std::ofstream{resultfile};
-    for (auto [qid, sid, pos] : result_2) {
-        ofs << qid/2 << " " << (qid%2)  << " " << sid << " " << pos << "\n";
+    auto out = HitWriter{resultfile, binary};
+    for (auto const& hit : result_2) {
+        if (binary) { // query index including the strand, as st_local_mapper expects it
+            out.write(hit);
+        } else {
+            out.writeColumns({hit.qid/2, hit.qid%2, hit.sid, hit.pos});
+        }
     }
+    out.flush();
     seqan3::debug_stream << "Saved results in " << resultfile << "\n";
 }
 
@@ -127,6 +133,9 @@ int main(int argc, char const* const* argv) {
     bool use_dna4{false};
     parser.add_flag(use_dna4, '\0', "dna4", "Use dna 4 alphabet");
 
+    bool binary{false};
+    parser.add_flag(binary, '\0', "binary", "Write the results as binary hit file (query id including the strand, subject id, position)");
+
     try {
         parser.parse();
     } catch (seqan3::argument_parser_error const& ext) {
@@ -155,9 +164,9 @@ int main(int argc, char const* const* argv) {
 
 
     if (use_dna4) {
-        search_index<my_dna4>(indexfile, queriesfile, outfile, errors);
+        search_index<my_dna4>(indexfile, queriesfile, outfile, errors, binary);
     } else {
-        search_index<my_dna5>(indexfile, queriesfile, outfile, errors);
+        search_index<my_dna5>(indexfile, queriesfile, outfile, errors, binary);
     }
 
 
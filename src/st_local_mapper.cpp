@@ -2,7 +2,14 @@
 // SPDX-FileCopyrightText: 2016-2023, Knut Reinert & MPI für molekulare Genetik
 // SPDX-License-Identifier: BSD-3-Clause
 
+#include "utils/HitFile.h"
+#include "utils/ParallelFor.h"
+
+#include <algorithm>
+#include <iterator>
 #include <ranges>
+#include <span>
+#include <sstream>
 #include <string>
 
 #include <seqan3/alignment/configuration/all.hpp>
@@ -30,31 +37,17 @@ auto readFasta(std::filesystem::path p) {
     return seqs;
 }
 
-auto readPosition(std::filesystem::path p) {
-    auto pos = std::vector<std::tuple<size_t, size_t, size_t>>{};
-    auto ifs = std::ifstream{p};
-
-    auto line = std::string{};
-    while(std::getline(ifs, line)) {
-        auto p0 = line.find(' ');
-        if (p0 == std::string::npos) continue;
-        auto p1 = line.find(' ', p0+1);
-        if (p1 == std::string::npos) continue;
-        auto s0 = line.substr(0, p0);
-        auto s1 = line.substr(p0+1, p1);
-        auto s2 = line.substr(p1+1);
-
-        if (s0 == "_" || s1 == "_" || s2 == "_") continue;
-
-        auto v0 = std::stod(s0);
-        auto v1 = std::stod(s1);
-        auto v2 = std::stod(s2);
-
-        pos.emplace_back(v0, v1, v2);
-    }
-
-    return pos;
-}
+/** one alignment, computed in parallel and written in input order */
+struct MappedRecord {
+    std::vector<seqan3::dna5>  seq;
+    size_t                     query{}; // index into the queries
+    size_t                     ref{};
+    uint64_t                   pos{};
+    std::vector<seqan3::cigar> cigar;
+    seqan3::sam_flag           flag{};
+    unsigned                   mapq{};
+    std::string                log;     // debug line
+};
 
 int main(int argc, char const* const* argv) {
     seqan3::argument_parser parser{"st_index_search", argc, argv};
@@ -80,9 +73,13 @@ int main(int argc, char const* const* argv) {
     bool reverseQueries{};
     parser.add_flag(reverseQueries, '\0', "reverse_queries", "Assumes every second query is a reverse complement query");
 
+    size_t threads{1};
+    parser.add_option(threads, '\0', "threads", "Number of threads aligning the hits, the output keeps the order of the positions file.");
+
 
     try {
         parser.parse();
+        threads = std::max<size_t>(1, threads);
         if (outFile.empty()) {
             outFile = positionFile;
             outFile.replace_extension(".sam");
@@ -94,14 +91,13 @@ int main(int argc, char const* const* argv) {
     auto refs    = readFasta(refFile);
     auto queries = readFasta(queryFile);
 
-    auto pos     = readPosition(positionFile);
+    // lines that aren't hits (e.g. '_ _ _' for unmapped queries) are skipped
+    auto pos     = readHits(positionFile, threads);
 
     auto listRefs = std::vector<std::string>{};
     auto listRefLen = std::vector<size_t>{};
-    for (auto [id, seq] : refs) {
-        id = id.substr(0, id.find(' '));
-
-        listRefs.push_back(id);
+    for (auto const& [id, seq] : refs) {
+        listRefs.push_back(id.substr(0, id.find(' ')));
         listRefLen.push_back(seq.size());
     }
 
@@ -116,62 +112,95 @@ int main(int argc, char const* const* argv) {
                                                    seqan3::field::flag,
                                                    seqan3::field::mapq>{}};
 
-    for (auto [qid, sid, spos] : pos) {
-        auto startPos = 0ul;
-        if (spos > errors) {
-            startPos = spos - errors;
-        }
-        auto [ref_id, ref_seq] = refs[sid];
-        ref_id = ref_id.substr(0, ref_id.find(' '));
-        auto [q_id, q_seq] = [&]() {
-            if (reverseQueries) {
-                return queries[qid/2];
+    // Configure the alignment kernel, once for all hits.
+    auto config = seqan3::align_cfg::method_global{
+        seqan3::align_cfg::free_end_gaps_sequence1_leading{true},
+        seqan3::align_cfg::free_end_gaps_sequence2_leading{false},
+        seqan3::align_cfg::free_end_gaps_sequence1_trailing{true},
+        seqan3::align_cfg::free_end_gaps_sequence2_trailing{false},
+    } |  seqan3::align_cfg::edit_scheme | seqan3::align_cfg::min_score{-errors};
+
+    // hits are aligned in batches, every thread aligns consecutive hits with a
+    // single align_pairwise call and its own buffers, records are written in input order
+    using Sequence = std::span<seqan3::dna5 const>;
+    auto batchSize = 4096 * threads;
+    auto slots     = std::vector<std::vector<MappedRecord>>(std::min(batchSize, pos.size()));
+    auto pairs     = std::vector<std::vector<std::pair<Sequence, Sequence>>>(threads);
+    auto reversed  = std::vector<std::vector<std::vector<seqan3::dna5>>>(threads);
+    auto logs      = std::vector<std::ostringstream>(threads);
+
+    for (size_t batch{0}; batch < pos.size(); batch += batchSize) {
+        auto n     = std::min(batchSize, pos.size() - batch);
+        auto parts = threads * 4;
+        parallelFor(threads, parts, [&](size_t part, size_t t) {
+            auto begin = n * part / parts;
+            auto end   = n * (part + 1) / parts;
+            if (begin == end) return;
+            auto& piecePairs = pairs[t];
+            auto& rev        = reversed[t];
+            piecePairs.clear();
+            rev.resize(std::max(rev.size(), end - begin));
+            for (auto i{begin}; i < end; ++i) {
+                auto [qid, sid, spos] = pos[batch + i];
+                auto const& ref_seq   = std::get<1>(refs[sid]);
+                auto const& q_seq     = std::get<1>(queries[reverseQueries ? qid/2 : qid]);
+
+                auto rhs = Sequence{q_seq};
+                if (reverseQueries && qid % 2 == 1) {
+                    rev[i - begin].clear();
+                    std::ranges::copy(q_seq | std::views::reverse | seqan3::views::complement, std::back_inserter(rev[i - begin]));
+                    rhs = rev[i - begin];
+                }
+                auto startPos = std::min<size_t>(ref_seq.size(), spos > errors ? spos - errors : 0);
+                auto endPos   = std::max(startPos, std::min(ref_seq.size(), spos + rhs.size() + errors));
+                piecePairs.emplace_back(Sequence{ref_seq}.subspan(startPos, endPos - startPos), rhs);
+                slots[i].clear();
             }
-            return queries[qid];
-        }();
 
-        seqan3::sam_flag flag{};
-        if (reverseQueries && qid % 2 == 1) {
-            q_seq = q_seq | std::views::reverse | seqan3::views::complement | seqan3::ranges::to<std::vector>();
-            flag = seqan3::sam_flag::on_reverse_strand;
-        }
-        auto rhs = q_seq;
-        auto endPos = std::min(ref_seq.size(), spos + rhs.size() + errors);
-        auto lhs = std::vector(ref_seq.begin()+startPos, ref_seq.begin()+endPos);
-
-        // Configure the alignment kernel.
-        auto config = seqan3::align_cfg::method_global{
-            seqan3::align_cfg::free_end_gaps_sequence1_leading{true},
-            seqan3::align_cfg::free_end_gaps_sequence2_leading{false},
-            seqan3::align_cfg::free_end_gaps_sequence1_trailing{true},
-            seqan3::align_cfg::free_end_gaps_sequence2_trailing{false},
-        } |  seqan3::align_cfg::edit_scheme | seqan3::align_cfg::min_score{-errors};
-        auto results = seqan3::align_pairwise(std::tie(lhs, rhs), config);
-        size_t i = 0;
-        for (auto res : results) {
-            using namespace seqan3::literals;
-            auto cigar = seqan3::cigar_from_alignment(res.alignment(), {}, true);
-            { // replace I at the beginning with substitutions
-                auto [cigar_ct, cigar_op] = cigar.front();
-                if (cigar_op == 'I'_cigar_operation) {
-                    cigar.front() = seqan3::cigar{cigar_ct, 'X'_cigar_operation};
-                    spos -= cigar_ct;
+            for (auto res : seqan3::align_pairwise(piecePairs, config)) {
+                using namespace seqan3::literals;
+                auto [lhs, rhs] = piecePairs[res.sequence1_id()];
+                auto i          = begin + res.sequence1_id();
+                auto [qid, sid, spos] = pos[batch + i];
+
+                seqan3::sam_flag flag{};
+                if (reverseQueries && qid % 2 == 1) {
+                    flag = seqan3::sam_flag::on_reverse_strand;
                 }
-            }
-            { // replace I at the end with substitutions
-                auto [cigar_ct, cigar_op] = cigar.back();
-                if (cigar_op == 'I'_cigar_operation) {
-                    cigar.back() = seqan3::cigar{cigar_ct, 'X'_cigar_operation};
+                auto cigar = seqan3::cigar_from_alignment(res.alignment(), {}, true);
+                { // replace I at the beginning with substitutions
+                    auto [cigar_ct, cigar_op] = cigar.front();
+                    if (cigar_op == 'I'_cigar_operation) {
+                        cigar.front() = seqan3::cigar{cigar_ct, 'X'_cigar_operation};
+                        spos -= cigar_ct;
+                    }
                 }
+                { // replace I at the end with substitutions
+                    auto [cigar_ct, cigar_op] = cigar.back();
+                    if (cigar_op == 'I'_cigar_operation) {
+                        cigar.back() = seqan3::cigar{cigar_ct, 'X'_cigar_operation};
+                    }
+                }
+                auto q_idx = reverseQueries ? qid/2 : qid;
+                auto& log  = logs[t];
+                log.str({});
+                auto dbg = seqan3::debug_stream_type{log};
+                dbg << slots[i].size() + 1 << " " << std::get<0>(queries[q_idx]) << " " <<  qid << " " << sid << " " << spos << " " << lhs << " " << rhs << " " << cigar << " " << res.score() << "\n";
+                slots[i].push_back({std::vector(rhs.begin(), rhs.end()), q_idx, sid, spos, std::move(cigar), flag, 60u + res.score(), log.str()});
+            }
+        });
+
+        for (size_t i{0}; i < n; ++i) {
+            for (auto const& r : slots[i]) {
+                seqan3::debug_stream << r.log;
+                sam_out.emplace_back(r.seq,
+                                     std::get<0>(queries[r.query]),
+                                     listRefs[r.ref],
+                                     r.pos,
+                                     r.cigar,
+                                     r.flag,
+                                     r.mapq);
             }
-            seqan3::debug_stream << ++i << " " << q_id << " " <<  qid << " " << sid << " " << spos << " " << lhs << " " << rhs << " " << cigar << " " << res.score() << "\n";
-            sam_out.emplace_back(rhs,
-                                 q_id,
-                                 ref_id,
-                                 spos,
-                                 cigar,
-                                 flag,
-                                 60u + res.score());
         }
     }
 
@@ -2,7 +2,17 @@
 // SPDX-FileCopyrightText: 2016-2023, Knut Reinert & MPI für molekulare Genetik
 // SPDX-License-Identifier: BSD-3-Clause
 
+#include "utils/BlockReader.h"
+#include "utils/BufferedWriter.h"
+#include "utils/MappedFile.h"
+#include "utils/ParallelFor.h"
+#include "utils/RecordTable.h"
+
+#include <cctype>
+#include <charconv>
 #include <filesystem>
+#include <numeric>
+#include <span>
 #include <seqan3/alphabet/nucleotide/dna5.hpp>
 #include <seqan3/argument_parser/all.hpp>
 #include <seqan3/core/debug_stream.hpp>
@@ -10,46 +20,164 @@
 #include <sstream>
 
 
+/** calls cb(value) for every whitespace separated unsigned integer in text, onInvalid(token) for all other tokens */
+template <typename CB1, typename CB2>
+void forEachNumber(std::string_view text, CB1&& cb, CB2&& onInvalid) {
+    auto p   = text.data();
+    auto end = text.data() + text.size();
+    while (p < end) {
+        if (std::isspace(static_cast<unsigned char>(*p))) {
+            ++p;
+            continue;
+        }
+        size_t value{};
+        auto [ptr, ec] = std::from_chars(p, end, value);
+        if (ec == std::errc{} && (ptr == end || std::isspace(static_cast<unsigned char>(*ptr)))) {
+            cb(value);
+            p = ptr;
+            continue;
+        }
+        auto tokenEnd = std::find_if(p, end, [](char c) { return std::isspace(static_cast<unsigned char>(c)); });
+        onInvalid(std::string_view{p, size_t(tokenEnd - p)});
+        p = tokenEnd;
+    }
+}
+
+/** Start positions of all sequences in the concatenated text
+ *
+ * Cached in "<fasta>.pos", as 8 byte magic followed by the positions as
+ * uint64_t, which is mapped into memory directly. The older text format
+ * (one number per line) is still read.
+ */
 struct Positions {
-    std::vector<size_t> positions;
-    Positions(std::filesystem::path infile) {
+    static constexpr auto magic = std::array<char, 8>{'S', 'T', 'P', 'O', 'S', 'B', 'I', '1'};
+    static_assert(sizeof(size_t) == sizeof(uint64_t));
+
+    std::vector<size_t>     storage;
+    MappedFile              mapped;
+    std::span<size_t const> positions;
+
+    Positions(std::filesystem::path infile, std::filesystem::path recordsFile) {
+        if (!recordsFile.empty()) { // boundaries written by st_fasta_dump --records
+            auto table = RecordTable::load(recordsFile).positions();
+            storage.assign(table.begin(), table.end());
+            positions = storage;
+            return;
+        }
         auto posfile = std::filesystem::path{infile.string() + ".pos"};
         if (!exists(posfile)) {
             seqan3::sequence_file_input fin{infile};
 
-            positions = {0};
+            storage = {0};
             // iterate through all sequences in input file
             for (auto & record : fin) {
                 auto seq = std::vector<seqan3::dna5>{record.sequence()};
-                positions.push_back(positions.back() + seq.size());
+                storage.push_back(storage.back() + seq.size());
             }
 
-            auto ofs = std::ofstream(posfile.string());
-            for (auto v : positions) {
-                ofs << v << "\n";
-            }
+            auto ofs = std::ofstream(posfile.string(), std::ios::binary);
+            ofs.write(magic.data(), magic.size());
+            ofs.write(reinterpret_cast<char const*>(storage.data()), storage.size() * sizeof(size_t));
         } else {
-            auto ifs = std::ifstream(posfile.string());
-            size_t pos{};
-            while(!ifs.eof()) {
-                ifs >> pos;
-                if (ifs.eof()) break;
-                positions.push_back(pos);
+            mapped = MappedFile{posfile};
+            if (mapped.size() >= magic.size() && std::memcmp(mapped.data(), magic.data(), magic.size()) == 0) {
+                positions = {reinterpret_cast<size_t const*>(mapped.data() + magic.size()), (mapped.size() - magic.size()) / sizeof(size_t)};
+                return;
             }
+            forEachNumber(mapped.view(), [&](size_t pos) {
+                storage.push_back(pos);
+            }, [](std::string_view token) {
+                seqan3::debug_stream << "ignoring: " << token << "\n";
+            });
         }
+        positions = storage;
     }
 
-    auto translate(size_t pos, size_t len) -> std::optional<std::tuple<size_t, size_t>> {
-        size_t idx{};
-        while (pos >= positions[idx]) {
-            ++idx;
+    using Result = std::optional<std::tuple<size_t, size_t>>;
+
+    /** index of the first entry larger than pos (branchless binary search) */
+    auto upperBound(size_t pos) const -> size_t {
+        if (positions.empty()) return 0;
+        auto base = positions.data();
+        auto n    = positions.size();
+        while (n > 1) {
+            auto half = n / 2;
+            base = (base[half] <= pos) ? base + half : base;
+            n   -= half;
         }
+        return (base - positions.data()) + (*base <= pos);
+    }
+
+    auto check(size_t idx, size_t pos, size_t len) const -> Result {
+        if (idx == 0 || idx >= positions.size()) return std::nullopt;
         if (pos + len > positions[idx]) return std::nullopt;
         pos -= positions[idx-1];
         return std::make_tuple(idx-1, pos);
     }
+
+    auto translate(size_t pos, size_t len) const -> Result {
+        return check(upperBound(pos), pos, len);
+    }
+
+    /** translates all positions with a single sweep over the sorted input, results are in input order */
+    void translateBatch(std::vector<size_t> const& input, size_t len, std::vector<Result>& results) const {
+        auto order = std::vector<size_t>(input.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::ranges::sort(order, [&](size_t lhs, size_t rhs) {
+            return input[lhs] < input[rhs];
+        });
+        results.resize(input.size());
+        size_t idx{0};
+        for (auto i : order) {
+            auto pos = input[i];
+            while (idx < positions.size() && positions[idx] <= pos) {
+                ++idx;
+            }
+            results[i] = check(idx, pos, len);
+        }
+    }
 };
 
+/** translates all positions of the block and appends the formatted results to out
+ *
+ * Tokens that are not positions are collected in invalid, so the caller can
+ * report them in input order.
+ */
+void translateBlock(Positions const& positions, std::string_view block, size_t length, bool batch, std::string& out, std::vector<std::string_view>& invalid) {
+    auto onInvalid = [&](std::string_view token) {
+        invalid.push_back(token);
+    };
+    auto print = [&](Positions::Result const& r) {
+        if (!r) {
+            out += "_ _\n";
+            return;
+        }
+        auto [idx, pos] = *r;
+        char buffer[48];
+        auto p = std::to_chars(buffer, buffer + 20, idx).ptr;
+        *p++   = ' ';
+        p      = std::to_chars(p, p + 20, pos).ptr;
+        *p++   = '\n';
+        out.append(buffer, p);
+    };
+
+    if (batch) {
+        auto input   = std::vector<size_t>{};
+        auto results = std::vector<Positions::Result>{};
+        forEachNumber(block, [&](size_t pos) {
+            input.push_back(pos);
+        }, onInvalid);
+        positions.translateBatch(input, length, results);
+        for (auto const& r : results) {
+            print(r);
+        }
+    } else {
+        forEachNumber(block, [&](size_t pos) {
+            print(positions.translate(pos, length));
+        }, onInvalid);
+    }
+}
+
 int main(int argc, char const* const* argv) {
     seqan3::argument_parser parser{"st_multistring_filter", argc, argv};
 
@@ -62,6 +190,15 @@ int main(int argc, char const* const* argv) {
     size_t length = 100;
     parser.add_positional_option(length, "length of the reads.");
 
+    std::filesystem::path recordsFile{};
+    parser.add_option(recordsFile, '\0', "records", "record table written by st_fasta_dump --records, avoids parsing the fasta file");
+
+    bool batch{false};
+    parser.add_flag(batch, '\0', "batch", "translate each input block sorted in one sweep");
+
+    size_t threads{1};
+    parser.add_option(threads, '\0', "threads", "number of threads translating input blocks in parallel");
+
     try {
          parser.parse();
     } catch (seqan3::argument_parser_error const& ext) {
@@ -70,17 +207,27 @@ int main(int argc, char const* const* argv) {
     }
 
 
-    auto positions = Positions(infile);
-    while(!std::cin.eof()) {
-        size_t pos;
-        std::cin >> pos;
-        if (std::cin.eof()) break;
-        auto r = positions.translate(pos, length);
-        if (r) {
-            auto [idx, pos] = *r;
-            std::cout << idx << " " << pos << "\n";
-        } else {
-            std::cout << "_ _" << "\n";
+    auto positions = Positions(infile, recordsFile);
+    auto in  = BlockReader{};
+    auto out = BufferedWriter{};
+
+    // each input block is split at line boundaries, translated in parallel and written in order
+    auto outputs = std::vector<std::string>{};
+    auto invalid = std::vector<std::vector<std::string_view>>{};
+    for (auto block = in.next(); !block.empty(); block = in.next()) {
+        auto pieces = splitAtLines(block, threads > 1 ? threads * 4 : 1);
+        outputs.resize(std::max(outputs.size(), pieces.size()));
+        invalid.resize(outputs.size());
+        parallelFor(threads, pieces.size(), [&](size_t i, size_t) {
+            outputs[i].clear();
+            invalid[i].clear();
+            translateBlock(positions, pieces[i], length, batch, outputs[i], invalid[i]);
+        });
+        for (size_t i{0}; i < pieces.size(); ++i) {
+            out.write(outputs[i]);
+            for (auto token : invalid[i]) {
+                seqan3::debug_stream << "ignoring: " << token << "\n";
+            }
         }
     }
 
@@ -2,6 +2,14 @@
 // SPDX-FileCopyrightText: 2016-2023, Knut Reinert & MPI für molekulare Genetik
 // SPDX-License-Identifier: BSD-3-Clause
 
+#include "utils/BlockReader.h"
+#include "utils/BufferedWriter.h"
+#include "utils/FastaIndex.h"
+#include "utils/MappedFile.h"
+#include "utils/NameIndex.h"
+
+#include <cctype>
+#include <charconv>
 #include <filesystem>
 #include <seqan3/alphabet/nucleotide/dna5.hpp>
 #include <seqan3/argument_parser/all.hpp>
@@ -10,58 +18,79 @@
 #include <sstream>
 
 struct Mapper {
-    std::vector<std::string>                positions;
-    std::unordered_map<std::string, size_t> mapLong;
-    std::unordered_map<std::string, size_t> mapShort;
-
-    Mapper(std::filesystem::path infile, bool rev) {
-        auto mapfile = std::filesystem::path{infile.string() + ".map"};
-        if (!exists(mapfile)) {
-            seqan3::sequence_file_input fin{infile};
-
-            // iterate through all sequences in input file
-            for (auto & record : fin) {
-                positions.push_back(record.id());
-            }
+    NameIndex index;
+    bool      rev;
+
+    Mapper(std::filesystem::path infile, bool revCompl)
+        : rev{revCompl}
+    {
+        auto mapfile   = std::filesystem::path{infile.string() + ".map"};
+        auto indexfile = std::filesystem::path{mapfile.string() + ".idx"};
+
+        // opening an up to date index is only a mmap call
+        if (isCacheUpToDate(indexfile, mapfile)) {
+            try {
+                index = NameIndex::open(indexfile);
+                return;
+            } catch (std::exception const&) {} // outdated format, rebuild
+        }
 
-            auto ofs = std::ofstream(mapfile.string());
-            for (auto v : positions) {
-                ofs << v << "\n";
+        auto names = std::vector<std::string_view>{};
+        auto text  = MappedFile{};
+        auto ids   = std::string{};
+        if (exists(mapfile)) {
+            text = MappedFile{mapfile};
+            for (auto v = text.view(); !v.empty();) {
+                auto line = v.substr(0, v.find('\n'));
+                v.remove_prefix(std::min(v.size(), line.size() + 1));
+                names.push_back(line);
             }
         } else {
-            auto ifs = std::ifstream(mapfile.string());
-            for (std::string pos; std::getline(ifs, pos);) {
-                positions.push_back(pos);
-            }
+            // only the headers are needed, skip decoding the sequences
+            text = MappedFile{infile};
+            text.adviseSequential();
+            scanFasta(text.view(), [&](FastaRecordInfo const& info) {
+                names.push_back(info.header);
+                ids += info.header;
+                ids += '\n';
+            });
+            auto ofs = std::ofstream(mapfile.string(), std::ios::binary);
+            ofs.write(ids.data(), ids.size());
         }
 
-        for (size_t i{0}; i < positions.size(); ++i) {
-            auto n = positions[i];
-            auto ns = n.substr(0, n.find(' '));
-            if (!rev) {
-                mapLong[n]   = i;
-                mapShort[ns] = i;
-
-            } else {
-                mapLong[n] = i*2;
-                mapLong[n+"_rev"] = i*2+1;
-                mapShort[ns] = i*2;
-                mapShort[ns+"_rev"] = i*2+1;
+        index = NameIndex::build(names);
+        try {
+            index.save(indexfile);
+        } catch (std::exception const&) {} // read only directory, keep it in memory
+    }
+
+    /** looks up a name, with rev the interleaved reverse complements are named "<name>_rev" */
+    template <typename Find>
+    auto lookup(std::string_view s, Find find) const -> size_t {
+        if (auto id = find(s)) {
+            return rev ? *id * 2 : *id;
+        }
+        if (rev && s.ends_with("_rev")) {
+            if (auto id = find(s.substr(0, s.size() - 4))) {
+                return *id * 2 + 1;
             }
         }
+        throw std::out_of_range{"unknown name: " + std::string{s}};
     }
-    auto translateShortToId(std::string const& s) const {
-        return mapShort.at(s);
+
+    auto translateShortToId(std::string_view s) const {
+        return lookup(s, [&](std::string_view n) { return index.findShort(n); });
     }
-    auto translateLongToId(std::string const& s) const {
-        return mapLong.at(s);
+    auto translateLongToId(std::string_view s) const {
+        return lookup(s, [&](std::string_view n) { return index.findLong(n); });
     }
     auto translateIdToShort(size_t i) const {
-        auto n = positions[i];
-        return n.substr(0, n.find(' '));
+        if (i >= index.size()) throw std::out_of_range{"unknown id: " + std::to_string(i)};
+        return index.shortName(i);
     }
     auto translateIdToLong(size_t i) const {
-        return positions[i];
+        if (i >= index.size()) throw std::out_of_range{"unknown id: " + std::to_string(i)};
+        return index.name(i);
     }
 };
 
@@ -93,23 +122,47 @@ int main(int argc, char const* const* argv) {
     }
 
     auto mapper = Mapper(infile, revCompl);
-    for (std::string pos; std::getline(std::cin, pos);) {
-        if (shortNames and !idToName) {
-            auto ns = pos.substr(0, pos.find(' '));
-            std::cout << mapper.translateShortToId(ns) << "\n";
-        } else if (!shortNames and !idToName) {
-            std::cout << mapper.translateLongToId(pos) << "\n";
-        } else if (shortNames and idToName) {
-            size_t i = std::stod(pos);
-            std::cout << mapper.translateIdToShort(i) << "\n";
-        } else if (!shortNames and idToName) {
-            size_t i = std::stod(pos);
-            std::cout << mapper.translateIdToLong(i) << "\n";
-        } else {
-            std::cerr << "This should never happen, please write a rage message to the author of this program\n";
+
+    // queries are read in large blocks and answered into a large output buffer, without per line allocations
+    auto in  = BlockReader{};
+    auto out = BufferedWriter{};
+    auto parseId = [](std::string_view s) -> size_t {
+        while (!s.empty() && std::isspace(static_cast<unsigned char>(s.front()))) s.remove_prefix(1);
+        size_t i{};
+        auto [ptr, ec] = std::from_chars(s.data(), s.data() + s.size(), i);
+        if (ec != std::errc{}) {
+            throw std::invalid_argument{"not an id: " + std::string{s}};
         }
+        return i;
+    };
+    // everything answered so far is still written if a query fails
+    auto line = std::string_view{};
+    try {
+        for (auto block = in.next(); !block.empty(); block = in.next()) {
+            while (!block.empty()) {
+                auto pos = block.substr(0, block.find('\n'));
+                block.remove_prefix(std::min(block.size(), pos.size() + 1));
+                line = pos;
+
+                if (shortNames and !idToName) {
+                    out.writeInt(mapper.translateShortToId(pos.substr(0, pos.find(' '))));
+                } else if (!shortNames and !idToName) {
+                    out.writeInt(mapper.translateLongToId(pos));
+                } else if (shortNames and idToName) {
+                    out.write(mapper.translateIdToShort(parseId(pos)));
+                } else if (!shortNames and idToName) {
+                    out.write(mapper.translateIdToLong(parseId(pos)));
+                } else {
+                    std::cerr << "This should never happen, please write a rage message to the author of this program\n";
+                }
+                out.put('\n');
+            }
+        }
+    } catch (std::exception const& e) {
+        out.flush();
+        seqan3::debug_stream << "failed on line \"" << line << "\": " << e.what() << "\n";
+        return EXIT_FAILURE;
     }
 
-
     return EXIT_SUCCESS;
 }
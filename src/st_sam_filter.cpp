@@ -2,12 +2,20 @@
 // SPDX-FileCopyrightText: 2016-2023, Knut Reinert & MPI für molekulare Genetik
 // SPDX-License-Identifier: BSD-3-Clause
 
+#include "utils/AlignmentFilter.h"
+#include "utils/Bam.h"
+#include "utils/BamIndex.h"
+#include "utils/BufferedWriter.h"
+#include "utils/ParallelFor.h"
+#include "utils/Sam.h"
+
 #include <filesystem>
 #include <seqan3/alphabet/nucleotide/dna5.hpp>
 #include <seqan3/argument_parser/all.hpp>
 #include <seqan3/core/debug_stream.hpp>
 #include <seqan3/io/sequence_file/all.hpp>
 #include <seqan3/io/sam_file/all.hpp>
+#include <memory>
 #include <sstream>
 #include <optional>
 
@@ -47,6 +55,54 @@ auto reverseComplement(std::vector<seqan3::dna5> input) {
     return input;
 }
 
+/** Filters batches of raw records in parallel
+ *
+ * classify(record, keep) sets keep[o] for every output o the record goes
+ * to. onKeep(o, record) is called for those in input order, at most maxNum
+ * times per output.
+ */
+template <typename Reader, typename Classify, typename CB>
+void filterRecords(Reader& in, size_t threads, size_t outputs, size_t maxNum, Classify&& classify, CB&& onKeep) {
+    auto records = std::vector<typename Reader::Record>{};
+    auto keep    = std::vector<uint8_t>{};
+    auto counts  = std::vector<size_t>(outputs);
+    auto open    = [&]() {
+        return std::ranges::any_of(counts, [&](size_t c) { return c < maxNum; });
+    };
+    while (open() && in.next(records)) {
+        keep.resize(records.size() * outputs);
+        auto parts = threads * 4;
+        parallelFor(threads, parts, [&](size_t part, size_t) {
+            for (size_t i{records.size() * part / parts}; i < records.size() * (part + 1) / parts; ++i) {
+                classify(records[i], keep.data() + i * outputs);
+            }
+        });
+        for (size_t i{0}; i < records.size(); ++i) {
+            for (size_t o{0}; o < outputs; ++o) {
+                if (keep[i * outputs + o] && counts[o] < maxNum) {
+                    onKeep(o, records[i]);
+                    counts[o] += 1;
+                }
+            }
+        }
+    }
+}
+
+/** an additional output with its own filter, see --route */
+struct Route {
+    std::filesystem::path file;
+    AlignmentFilter       filter;
+};
+
+/** splits 'name=value' */
+auto splitAssignment(std::string const& text) -> std::pair<std::string, std::string> {
+    auto eq = text.find('=');
+    if (eq == std::string::npos || eq == 0) {
+        throw seqan3::argument_parser_error{"expected 'name=expression', got: " + text};
+    }
+    return {text.substr(0, eq), text.substr(eq + 1)};
+}
+
 int main(int argc, char const* const* argv) {
     seqan3::argument_parser parser{"st_sam_filter", argc, argv};
 
@@ -76,7 +132,7 @@ int main(int argc, char const* const* argv) {
     parser.add_flag(noDeletions, '\0', "noDeletions", "filter out all alignments with Deletions");
 
     size_t maxNum{std::numeric_limits<size_t>::max()};
-    parser.add_option(maxNum, '\0', "num", "number of alignments to pass through");
+    parser.add_option(maxNum, '\0', "num", "number of alignments to pass through (per output)");
 
     std::filesystem::path fastaFile{};
     parser.add_option(fastaFile, '\0', "fasta", "optional output of all the alignment as fasta reads");
@@ -84,60 +140,195 @@ int main(int argc, char const* const* argv) {
     bool convertToDna4{false};
     parser.add_flag(convertToDna4, '\0', "dna4", "converts all Ns randomly to ACGT");
 
+    std::string expression;
+    parser.add_option(expression, '\0', "expr", "filter expression records must pass in addition to the options above, e.g. 'mapq >= 30 && !secondary && tag.NM <= 2'");
+
+    std::vector<std::string> definitions;
+    parser.add_option(definitions, '\0', "define", "named filter 'name=expression' that can be used in later expressions");
+
+    std::vector<std::string> routeArgs;
+    parser.add_option(routeArgs, '\0', "route", "additional output 'file=expression', receives every record passing the expression, in the same single pass");
+
+    size_t threads{1};
+    parser.add_option(threads, '\0', "threads", "number of threads, records are filtered and bam files (de)compressed in parallel");
+
+    std::vector<std::string> regionArgs;
+    parser.add_option(regionArgs, '\0', "region", "only read records overlapping 'ref:begin-end' (1-based, inclusive), requires a sorted bam input with .bai or .csi index");
+
+    bool writeIndex{false};
+    parser.add_flag(writeIndex, '\0', "index", "write a .bai index next to every bam output, which must be sorted by coordinate");
+
+    bool lazy{};
+    auto mainFilter = std::optional<AlignmentFilter>{};
+    auto routes     = std::vector<Route>{};
+    auto regions    = std::vector<Region>{};
     try {
          parser.parse();
+         // records can be passed through unchanged if input and output have the same format
+         lazy = (isBamFile(in_file) && isBamFile(out_file)) || (isSamFile(in_file) && isSamFile(out_file));
+         if (threads > 1 && !lazy) {
+             throw seqan3::argument_parser_error{"--threads requires input and output of the same format, both sam or both bam"};
+         }
+         if ((!expression.empty() || !definitions.empty() || !routeArgs.empty()) && !lazy) {
+             throw seqan3::argument_parser_error{"filter expressions require input and output of the same format, both sam or both bam"};
+         }
+         if ((!regionArgs.empty() || writeIndex) && !(lazy && isBamFile(in_file))) {
+             throw seqan3::argument_parser_error{"--region and --index require bam input and output"};
+         }
+         for (auto const& r : regionArgs) {
+             regions.push_back(Region::parse(r));
+         }
+
+         // all expressions are compiled once, up front
+         auto named = std::map<std::string, AlignmentFilter, std::less<>>{};
+         for (auto const& d : definitions) {
+             auto [name, expr] = splitAssignment(d);
+             named[name] = AlignmentFilter::compile(expr, named);
+         }
+         if (!expression.empty()) {
+             mainFilter = AlignmentFilter::compile(expression, named);
+         }
+         for (auto const& r : routeArgs) {
+             auto [file, expr] = splitAssignment(r);
+             if (isBamFile(file) != isBamFile(in_file) || isSamFile(file) != isSamFile(in_file)) {
+                 throw seqan3::argument_parser_error{"route " + file + " must have the format of the input"};
+             }
+             routes.push_back({file, AlignmentFilter::compile(expr, named)});
+         }
+    } catch (std::invalid_argument const& ext) {
+        seqan3::debug_stream << "Parsing error. " << ext.what() << "\n";
+        return EXIT_FAILURE;
     } catch (seqan3::argument_parser_error const& ext) {
         seqan3::debug_stream << "Parsing error. " << ext.what() << "\n";
         return EXIT_FAILURE;
     }
 
-    auto fin  = seqan3::sam_file_input{in_file};
-    auto fout = seqan3::sam_file_output{out_file};
+    auto passes = [&](CigarCounts const& c) {
+        return minErrors <= c.errors && c.errors <= error
+            && (!noMismatches || c.mismatches == 0)
+            && (!noInsertions || c.insertions == 0)
+            && (!noDeletions  || c.deletions == 0);
+    };
 
     auto fastaOut = [&]() -> std::optional<decltype(seqan3::sequence_file_output{fastaFile})> {
         if (fastaFile.empty()) return std::nullopt;
         return seqan3::sequence_file_output{fastaFile};
     }();
+    auto writeFasta = [&](std::vector<seqan3::dna5> seq, auto const& id, bool reverse) {
+        if (convertToDna4) {
+            seq = convertDna5ToDna4(std::move(seq));
+        }
+        if (reverse) {
+            seq = reverseComplement(std::move(seq));
+        }
+        fastaOut->emplace_back(seq, id);
+    };
+
+    if (lazy) {
+        // errors like unsorted output with --index or broken input end here, the writers still finish their files
+        try {
+            // only the CIGAR is decoded, passing records are copied as raw bytes
+            auto seqChars = std::string{};
+            auto onKeep   = [&](auto const& record) {
+                if (!fastaOut) return;
+                record.sequence(seqChars);
+                auto seq = std::vector<seqan3::dna5>(seqChars.size());
+                for (size_t i{0}; i < seqChars.size(); ++i) {
+                    seq[i] = seqan3::assign_char_to(seqChars[i], seqan3::dna5{});
+                }
+                auto oS = record.tag("oS");
+                writeFasta(std::move(seq), std::string{record.readName()}, oS && oS->first == 'A' && oS->second == "R");
+            };
+
+            // output 0 is the main output, followed by the routes
+            auto outputs  = routes.size() + 1;
+            auto classify = [&](AlignmentFields const& fields, uint8_t* keep) {
+                keep[0] = passes(fields.cigar) && (!mainFilter || (*mainFilter)(fields));
+                for (size_t r{0}; r < routes.size(); ++r) {
+                    keep[r + 1] = routes[r].filter(fields);
+                }
+            };
+
+            if (isBamFile(in_file)) {
+                auto fin   = BamReader{in_file, threads};
+                auto files = std::vector<std::filesystem::path>{out_file};
+                for (auto const& r : routes) {
+                    files.push_back(r.file);
+                }
+                auto fout = std::vector<std::unique_ptr<BamWriter>>{};
+                for (auto const& f : files) {
+                    fout.push_back(std::make_unique<BamWriter>(f, fin.header, threads, writeIndex));
+                }
+                auto run = [&](auto& reader) {
+                    filterRecords(reader, threads, outputs, maxNum, [&](BamRecord const& record, uint8_t* keep) {
+                        classify(AlignmentFields::of(record, fin.header), keep);
+                    }, [&](size_t o, BamRecord const& record) {
+                        fout[o]->write(record);
+                        if (o == 0) onKeep(record);
+                    });
+                };
+                if (regions.empty()) {
+                    run(fin);
+                } else {
+                    auto indexFile = BamIndex::find(in_file);
+                    if (!indexFile) {
+                        seqan3::debug_stream << "no index (.bai or .csi) found for " << in_file << "\n";
+                        return EXIT_FAILURE;
+                    }
+                    auto reader = BamRegionReader{fin, BamIndex::load(*indexFile), regions};
+                    run(reader);
+                }
+                for (size_t o{0}; o < fout.size(); ++o) {
+                    fout[o]->close(writeIndex ? std::filesystem::path{files[o].string() + ".bai"} : std::filesystem::path{});
+                }
+            } else {
+                auto fin  = SamReader{in_file};
+                auto fout = std::vector<std::unique_ptr<BufferedWriter>>{};
+                fout.push_back(std::make_unique<BufferedWriter>(out_file));
+                for (auto const& r : routes) {
+                    fout.push_back(std::make_unique<BufferedWriter>(r.file));
+                }
+                for (auto& f : fout) {
+                    f->write(fin.header);
+                }
+                filterRecords(fin, threads, outputs, maxNum, [&](SamRecord const& record, uint8_t* keep) {
+                    classify(AlignmentFields::of(record), keep);
+                }, [&](size_t o, SamRecord const& record) {
+                    fout[o]->write(record.line);
+                    fout[o]->put('\n');
+                    if (o == 0) onKeep(record);
+                });
+            }
+        } catch (std::exception const& e) {
+            seqan3::debug_stream << e.what() << "\n";
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
+    }
+
+    auto fin  = seqan3::sam_file_input{in_file};
+    auto fout = seqan3::sam_file_output{out_file};
 
     size_t count{};
     for (auto & record : fin) {
-        size_t countErrors{};
-        size_t countMismatches{};
-        size_t countInsertions{};
-        size_t countDeletions{};
+        auto counts = CigarCounts{};
         for (auto [ct, op] : record.cigar_sequence()) {
-            if (op.to_char() != 'M' && op.to_char() != '=') {
-                countErrors += ct;
-            }
-            if (op.to_char() == 'X') {
-                countMismatches += ct;
-            } else if (op.to_char() == 'I') {
-                countInsertions += ct;
-            } else if (op.to_char() == 'D') {
-                countDeletions += ct;
-            }
+            counts.add(ct, op.to_char());
         }
-        if (minErrors <= countErrors && countErrors <= error
-            && (!noMismatches || countMismatches == 0)
-            && (!noInsertions || countInsertions == 0)
-            && (!noDeletions  || countDeletions == 0)) {
+        if (passes(counts)) {
             count += 1;
             fout.push_back(record);
             if (fastaOut) {
-                auto seq = std::vector<seqan3::dna5>{record.sequence()};
-                if (convertToDna4) {
-                    seq = convertDna5ToDna4(std::move(seq));
-                }
-
+                bool reverse{false};
                 using seqan3::operator""_tag;
                 for (auto const& [key, value] : record.tags()) {
                     if (key == "oS"_tag) {
                         if (std::get<char>(value) == 'R') {
-                            seq = reverseComplement(std::move(seq));
+                            reverse = true;
                         }
                     }
                 }
-                fastaOut->emplace_back(seq, record.id());
+                writeFasta(std::vector<seqan3::dna5>{record.sequence()}, record.id(), reverse);
             }
         }
         if (count == maxNum) break;
@@ -2,14 +2,472 @@
 // SPDX-FileCopyrightText: 2016-2023, Knut Reinert & MPI für molekulare Genetik
 // SPDX-License-Identifier: BSD-3-Clause
 
+#include "utils/Bam.h"
+#include "utils/BamIndex.h"
+#include "utils/Json.h"
+#include "utils/MappedFile.h"
+#include "utils/ParallelFor.h"
+#include "utils/Sam.h"
+
+#include <array>
+#include <charconv>
+#include <cmath>
 #include <filesystem>
+#include <fstream>
+#include <limits>
+#include <numeric>
+#include <random>
 #include <seqan3/alphabet/nucleotide/dna5.hpp>
 #include <seqan3/argument_parser/all.hpp>
 #include <seqan3/core/debug_stream.hpp>
 #include <seqan3/io/sequence_file/all.hpp>
 #include <seqan3/io/sam_file/all.hpp>
 #include <sstream>
+#include <unordered_map>
+
+/** the fields besides the CIGAR the detailed statistics need, decoded from either format */
+struct RecordInfo {
+    uint16_t         flag{};
+    uint8_t          mapq{};
+    int64_t          ref{-1}; // index of the reference, -1 if unknown
+    int64_t          tlen{};
+    std::string_view md;      // MD tag, empty if missing
+};
+
+/** walks the mismatches of an MD tag, as indices into the aligned (M/=/X) bases */
+struct MdMismatches {
+    std::string_view md;
+    uint64_t         aligned{}; // aligned bases described by the consumed part of md
+
+    static constexpr auto none = std::numeric_limits<uint64_t>::max();
+
+    /** index of the next mismatch, 'none' at the end */
+    auto next() -> uint64_t {
+        while (!md.empty()) {
+            if (md[0] >= '0' && md[0] <= '9') {
+                uint64_t matches{};
+                auto [ptr, ec] = std::from_chars(md.data(), md.data() + md.size(), matches);
+                aligned += matches;
+                md.remove_prefix(ptr - md.data());
+            } else if (md[0] == '^') { // deleted reference bases, not part of the read
+                md.remove_prefix(1);
+                while (!md.empty() && (md[0] < '0' || md[0] > '9')) md.remove_prefix(1);
+            } else {
+                md.remove_prefix(1);
+                return aligned++;
+            }
+        }
+        return none;
+    }
+};
+
+/** Error and CIGAR operation counts, flat arrays so per thread instances are cheap to update and merge */
+struct CigarStats {
+    size_t                  records{};
+    size_t                  bases{};       // sum of all CIGAR element lengths
+    std::array<size_t, 256> byOperation{}; // indexed by CIGAR operation character
+    std::vector<size_t>     byErrors;      // number of records by error count
+
+    /** counts a record, cigar(cb) calls cb(length, operation) for every CIGAR element */
+    template <typename Cigar>
+    void add(Cigar&& cigar) {
+        size_t errors{};
+        cigar([&](uint32_t ct, char op) {
+            if (op != 'M' && op != '=') {
+                errors += ct;
+            }
+            bases += ct;
+            byOperation[static_cast<unsigned char>(op)] += ct;
+        });
+        if (byErrors.size() <= errors) {
+            byErrors.resize(errors + 1);
+        }
+        byErrors[errors] += 1;
+        records += 1;
+    }
+
+    void merge(CigarStats const& other) {
+        records += other.records;
+        bases   += other.bases;
+        for (size_t i{0}; i < byOperation.size(); ++i) {
+            byOperation[i] += other.byOperation[i];
+        }
+        byErrors.resize(std::max(byErrors.size(), other.byErrors.size()));
+        for (size_t i{0}; i < other.byErrors.size(); ++i) {
+            byErrors[i] += other.byErrors[i];
+        }
+    }
+};
+
+/** CIGAR statistics plus details, with fixed size counters */
+struct SamStats : CigarStats {
+    static constexpr size_t maxInsertSize   = 10'000; // larger insert sizes are counted as maxInsertSize
+    static constexpr size_t maxReadPosition = 1'000;  // later read positions are counted as maxReadPosition
+
+    struct ReferenceStats {
+        size_t   records{};
+        uint64_t alignedBases{};
+    };
+
+    // details, only primary mapped records are counted
+    size_t                                  mapped{};
+    size_t                                  unmapped{};
+    size_t                                  secondary{};
+    size_t                                  supplementary{};
+    std::array<size_t, 256>                 byMapq{};
+    std::array<size_t, maxInsertSize + 1>   byInsertSize{};           // |TLEN| of the first read of a pair
+    std::array<size_t, maxReadPosition + 1> alignedByReadPosition{};  // in sequencing order
+    std::array<size_t, maxReadPosition + 1> mismatchesByReadPosition{};
+    std::vector<ReferenceStats>             byReference;
+
+    explicit SamStats(size_t references = 0)
+        : byReference(references)
+    {}
+
+    using CigarStats::add;
+
+    /** counts a record including the details */
+    template <typename Cigar>
+    void add(Cigar&& cigar, RecordInfo const& info) {
+        CigarStats::add(cigar);
+        if (info.flag & 0x4)   { unmapped      += 1; return; }
+        if (info.flag & 0x100) { secondary     += 1; return; }
+        if (info.flag & 0x800) { supplementary += 1; return; }
+        mapped += 1;
+        byMapq[info.mapq] += 1;
+        if ((info.flag & 0x41) == 0x41 && info.tlen != 0) {
+            byInsertSize[std::min<uint64_t>(std::abs(info.tlen), maxInsertSize)] += 1;
+        }
+
+        // mismatches are taken from =/X operations, or from the MD tag if there are none
+        size_t readLength{};
+        bool   explicitMismatches{false};
+        cigar([&](uint32_t ct, char op) {
+            if (op == 'M' || op == 'I' || op == 'S' || op == '=' || op == 'X') readLength += ct;
+            if (op == '=' || op == 'X') explicitMismatches = true;
+        });
+        auto count = [&](auto& counters, size_t queryPos) {
+            auto p = (info.flag & 0x10) ? readLength - 1 - queryPos : queryPos;
+            counters[std::min(p, maxReadPosition)] += 1;
+        };
+        auto     md           = MdMismatches{explicitMismatches ? std::string_view{} : info.md};
+        auto     nextMismatch = md.next();
+        size_t   queryPos{};
+        uint64_t aligned{};
+        cigar([&](uint32_t ct, char op) {
+            switch (op) {
+            case 'M': case '=': case 'X':
+                for (size_t i{0}; i < ct; ++i) {
+                    count(alignedByReadPosition, queryPos + i);
+                    if (op == 'X') count(mismatchesByReadPosition, queryPos + i);
+                }
+                for (; nextMismatch < aligned + ct; nextMismatch = md.next()) {
+                    count(mismatchesByReadPosition, queryPos + (nextMismatch - aligned));
+                }
+                queryPos += ct;
+                aligned  += ct;
+                break;
+            case 'I': case 'S':
+                queryPos += ct;
+                break;
+            }
+        });
+        if (info.ref >= 0 && static_cast<size_t>(info.ref) < byReference.size()) {
+            byReference[info.ref].records      += 1;
+            byReference[info.ref].alignedBases += aligned;
+        }
+    }
+
+    void merge(SamStats const& other) {
+        auto addAll = [](auto& lhs, auto const& rhs) {
+            for (size_t i{0}; i < rhs.size(); ++i) {
+                lhs[i] += rhs[i];
+            }
+        };
+        CigarStats::merge(other);
+        mapped        += other.mapped;
+        unmapped      += other.unmapped;
+        secondary     += other.secondary;
+        supplementary += other.supplementary;
+        addAll(byMapq, other.byMapq);
+        addAll(byInsertSize, other.byInsertSize);
+        addAll(alignedByReadPosition, other.alignedByReadPosition);
+        addAll(mismatchesByReadPosition, other.mismatchesByReadPosition);
+        for (size_t i{0}; i < other.byReference.size(); ++i) {
+            byReference[i].records      += other.byReference[i].records;
+            byReference[i].alignedBases += other.byReference[i].alignedBases;
+        }
+    }
+};
+
+/** Collects the statistics of all records, batches are split over the threads
+ *
+ * Records are only decoded and the details only counted with 'details',
+ * otherwise just the CIGAR statistics are collected.
+ */
+template <typename Reader, typename Decode>
+auto collectStats(Reader& in, size_t threads, size_t references, bool details, Decode&& decode) -> SamStats {
+    auto perThread = std::vector<SamStats>(threads, SamStats{references});
+    auto records   = std::vector<typename Reader::Record>{};
+    while (in.next(records)) {
+        auto parts = threads * 4;
+        parallelFor(threads, parts, [&](size_t part, size_t threadId) {
+            for (size_t i{records.size() * part / parts}; i < records.size() * (part + 1) / parts; ++i) {
+                auto cigar = [&](auto&& cb) { records[i].forEachCigar(cb); };
+                if (details) {
+                    perThread[threadId].add(cigar, decode(records[i]));
+                } else {
+                    perThread[threadId].add(cigar);
+                }
+            }
+        });
+    }
+    for (size_t t{1}; t < threads; ++t) {
+        perThread[0].merge(perThread[t]);
+    }
+    return std::move(perThread[0]);
+}
+
+/** Statistics of randomly chosen pieces of a BAM file, one CigarStats per piece
+ *
+ * The compressed file is split into equally sized strata and a segment of
+ * consecutive blocks starting at a random offset is read from each, so
+ * about 'fraction' of the file is decompressed. A segment only reads blocks
+ * that start inside its stratum and only counts records that start and end
+ * inside the segment, so no record is counted twice. Segments start at record
+ * offsets listed in the index if there is one, otherwise at the first
+ * block header and the first position that looks like a record chain.
+ */
+struct SampledStats {
+    std::vector<CigarStats> segments;
+    uint64_t                bytesRead{}; // compressed bytes of all sampled segments
+    uint64_t                bytesTotal{};
+};
+
+auto sampleStats(std::filesystem::path const& file, double fraction, size_t threads, uint64_t seed) -> SampledStats {
+    auto result   = SampledStats{};
+    auto refCount = size_t{};
+    auto first    = uint64_t{}; // file offset of the block holding the first record
+    {
+        auto fin     = BamReader{file};
+        auto records = std::vector<BamRecord>{};
+        if (!fin.next(records)) return result;
+        refCount = fin.header.references.size();
+        first    = fin.virtualOffset(records.front()) >> 16;
+    }
+
+    auto recordStarts = std::vector<uint64_t>{}; // virtual offsets
+    if (auto indexFile = BamIndex::find(file)) {
+        for (auto const& ref : BamIndex::load(*indexFile).references) {
+            for (auto const& [bin, chunks] : ref.bins) {
+                for (auto const& c : chunks) {
+                    recordStarts.push_back(c.begin);
+                }
+            }
+        }
+        std::ranges::sort(recordStarts);
+    }
+
+    auto mapped        = MappedFile{file};
+    auto bytes         = mapped.view();
+    result.bytesTotal  = bytes.size() - first;
+    auto budget        = fraction * result.bytesTotal;
+    auto segmentCount  = std::max<size_t>(16, budget / (256 << 10));
+    auto stratumSize   = result.bytesTotal / segmentCount;
+    auto segmentSize   = std::max<uint64_t>(1, budget / segmentCount);
+    auto bytesRead     = std::vector<uint64_t>(segmentCount);
+    result.segments.resize(segmentCount);
+
+    parallelFor(threads, segmentCount, [&](size_t i, size_t) {
+        auto rng        = std::mt19937_64{seed * segmentCount + i};
+        auto stratum    = first + i * stratumSize;
+        auto stratumEnd = i + 1 < segmentCount ? stratum + stratumSize : bytes.size();
+        auto start      = stratum + std::uniform_int_distribution<uint64_t>{0, stratumSize - std::min(stratumSize, segmentSize)}(rng);
+        auto block      = uint64_t{};
+        auto inBlock    = std::string_view::npos; // record offset in the first block, if known
+        auto indexed    = std::ranges::lower_bound(recordStarts, start << 16);
+        if (indexed != recordStarts.end() && (*indexed >> 16) < stratumEnd) {
+            block   = *indexed >> 16;
+            inBlock = *indexed & 0xffff;
+        } else {
+            block = bgzfFindBlock(bytes, start);
+        }
+
+        // blocks starting behind the stratum belong to the next segment
+        auto data = std::vector<char>{};
+        auto end  = block;
+        while (end < stratumEnd && (end == block || end - block < segmentSize)) {
+            auto blockData = bytes.substr(end, std::min(bytes.size() - end, bgzfMaxBlockSize));
+            auto size      = bgzfBlockSize(blockData);
+            if (size == 0 || size > blockData.size()) break;
+            auto offset = data.size();
+            data.resize(offset + bgzfUncompressedSize(blockData.substr(0, size)));
+            bgzfInflate(blockData.substr(0, size), data.data() + offset);
+            end += size;
+        }
+        bytesRead[i] = end - block;
+
+        auto view = std::string_view{data.data(), data.size()};
+        auto p    = inBlock != std::string_view::npos ? inBlock : bamFindRecord(view, refCount);
+        while (p < view.size() && view.size() - p >= 4) {
+            auto size = size_t{loadLE<uint32_t>(view.data() + p)} + 4;
+            if (size > view.size() - p) break; // continues behind the segment
+            auto record = BamRecord{view.substr(p, size)};
+            if (!record.isComplete()) throw std::runtime_error("corrupt BAM record");
+            result.segments[i].add([&](auto&& cb) { record.forEachCigar(cb); });
+            p += size;
+        }
+    });
+    result.bytesRead = std::accumulate(bytesRead.begin(), bytesRead.end(), uint64_t{});
+    return result;
+}
+
+/** 97.5% quantile of Student's t distribution, for two sided 95% intervals */
+auto tQuantile975(size_t degreesOfFreedom) -> double {
+    static constexpr auto table = std::array{12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+                                             2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+                                             2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042};
+    if (degreesOfFreedom == 0) return std::numeric_limits<double>::infinity();
+    if (degreesOfFreedom <= table.size()) return table[degreesOfFreedom - 1];
+    return degreesOfFreedom <= 60 ? 2.000 : 1.960;
+}
+
+/** Ratio estimate sum(x)/sum(n) over the sampled segments and the half width of its 95% confidence interval
+ *
+ * Segments are treated as clusters, records of the same segment are not
+ * independent of each other.
+ */
+auto ratioEstimate(std::vector<double> const& x, std::vector<double> const& n, double sampledFraction) -> std::pair<double, double> {
+    auto k     = x.size();
+    auto sumX  = std::accumulate(x.begin(), x.end(), 0.);
+    auto sumN  = std::accumulate(n.begin(), n.end(), 0.);
+    if (sumN == 0 || k < 2) return {0., 0.};
+    auto ratio = sumX / sumN;
+    auto meanN = sumN / k;
+    double squares{};
+    for (size_t i{0}; i < k; ++i) {
+        squares += (x[i] - ratio * n[i]) * (x[i] - ratio * n[i]);
+    }
+    auto variance = std::max(0., 1. - sampledFraction) * squares / (k - 1) / (k * meanN * meanN);
+    return {ratio, tQuantile975(k - 1) * std::sqrt(variance)};
+}
+
+void printEstimates(SampledStats const& sampled) {
+    auto const& segments = sampled.segments;
+    auto total           = CigarStats{};
+    for (auto const& s : segments) {
+        total.merge(s);
+    }
+    auto sampledFraction = sampled.bytesTotal ? std::min(1., double(sampled.bytesRead) / sampled.bytesTotal) : 0.;
+    auto column          = [&](auto get) {
+        auto values = std::vector<double>{};
+        for (auto const& s : segments) {
+            values.push_back(get(s));
+        }
+        return values;
+    };
+    auto records = column([](CigarStats const& s) { return double(s.records); });
+    auto bases   = column([](CigarStats const& s) { return double(s.bases); });
+
+    std::cout << "sampled " << segments.size() << " segments, " << sampledFraction * 100. << "% of the file, "
+              << total.records << " reads (about " << size_t(sampledFraction > 0 ? total.records / sampledFraction : 0) << " in total)\n"
+              << "estimates with 95% confidence intervals\n\n";
+
+    std::cout << "by error count:\n";
+    for (size_t error{0}; error < total.byErrors.size(); ++error) {
+        if (total.byErrors[error] == 0) continue;
+        auto withError = column([&](CigarStats const& s) { return error < s.byErrors.size() ? double(s.byErrors[error]) : 0.; });
+        auto [share, width] = ratioEstimate(withError, records, sampledFraction);
+        std::cout << share * 100. << "% ± " << width * 100. << "% of reads with " << error << " errors" << "\n";
+    }
+    std::cout << "\nby type\n";
+    for (size_t c{0}; c < total.byOperation.size(); ++c) {
+        if (total.byOperation[c] == 0) continue;
+        auto ct = column([&](CigarStats const& s) { return double(s.byOperation[c]); });
+        auto [perRead, readWidth] = ratioEstimate(ct, records, sampledFraction);
+        auto [perBase, baseWidth] = ratioEstimate(ct, bases, sampledFraction);
+        std::cout << char(c) << " occurs " << perRead << " ± " << readWidth << " times per read or "
+                  << perBase << " ± " << baseWidth << " per base\n";
+    }
+}
+
+/** writes the statistics as json report, throws std::runtime_error if the file can not be written */
+void writeJson(std::filesystem::path const& file, SamStats const& stats, std::vector<std::pair<std::string, uint64_t>> const& references) {
+    // histograms are written as objects with the non zero entries only
+    auto histogram = [](std::ostream& out, auto const& counts) {
+        out << "{";
+        bool first = true;
+        for (size_t i{0}; i < counts.size(); ++i) {
+            if (counts[i] == 0) continue;
+            out << (first ? "" : ", ") << "\"" << i << "\": " << counts[i];
+            first = false;
+        }
+        out << "}";
+    };
+    auto positions = size_t{0};
+    for (size_t i{0}; i < stats.alignedByReadPosition.size(); ++i) {
+        if (stats.alignedByReadPosition[i] > 0) positions = i + 1;
+    }
+    auto array = [&](std::ostream& out, auto const& counts) {
+        out << "[";
+        for (size_t i{0}; i < positions; ++i) {
+            out << (i ? ", " : "") << counts[i];
+        }
+        out << "]";
+    };
+    uint64_t insertSizes{}, insertSizeSum{};
+    for (size_t i{0}; i < stats.byInsertSize.size(); ++i) {
+        insertSizes   += stats.byInsertSize[i];
+        insertSizeSum += i * stats.byInsertSize[i];
+    }
 
+    auto json = std::ofstream{file};
+    if (!json) {
+        throw std::runtime_error("can not open " + file.string() + " for writing");
+    }
+    json << "{\n"
+         << "  \"records\": " << stats.records << ",\n"
+         << "  \"bases\": " << stats.bases << ",\n"
+         << "  \"mapped\": " << stats.mapped << ",\n"
+         << "  \"unmapped\": " << stats.unmapped << ",\n"
+         << "  \"secondary\": " << stats.secondary << ",\n"
+         << "  \"supplementary\": " << stats.supplementary << ",\n"
+         << "  \"by_error_count\": ";
+    histogram(json, stats.byErrors);
+    json << ",\n  \"cigar_operations\": {";
+    bool first = true;
+    for (size_t c{0}; c < stats.byOperation.size(); ++c) {
+        if (stats.byOperation[c] == 0) continue;
+        json << (first ? "" : ", ") << jsonString(std::string(1, char(c))) << ": " << stats.byOperation[c];
+        first = false;
+    }
+    json << "},\n  \"mapq\": ";
+    histogram(json, stats.byMapq);
+    json << ",\n  \"insert_size\": {\"pairs\": " << insertSizes
+         << ", \"mean\": " << (insertSizes ? double(insertSizeSum) / insertSizes : 0.)
+         << ", \"max_bin\": " << SamStats::maxInsertSize
+         << ", \"histogram\": ";
+    histogram(json, stats.byInsertSize);
+    json << "},\n  \"aligned_by_read_position\": ";
+    array(json, stats.alignedByReadPosition);
+    json << ",\n  \"mismatches_by_read_position\": ";
+    array(json, stats.mismatchesByReadPosition);
+    json << ",\n  \"references\": [";
+    for (size_t r{0}; r < references.size(); ++r) {
+        auto const& [name, length] = references[r];
+        auto const& s = stats.byReference[r];
+        json << (r ? ",\n" : "\n") << "    {\"name\": " << jsonString(name)
+             << ", \"length\": " << length
+             << ", \"records\": " << s.records
+             << ", \"aligned_bases\": " << s.alignedBases
+             << ", \"mean_depth\": " << (length ? double(s.alignedBases) / length : 0.) << "}";
+    }
+    json << "\n  ]\n}\n";
+    json.flush();
+    if (!json) {
+        throw std::runtime_error("failed writing " + file.string());
+    }
+}
 
 int main(int argc, char const* const* argv) {
     seqan3::argument_parser parser{"st_sam_info", argc, argv};
@@ -21,43 +479,109 @@ int main(int argc, char const* const* argv) {
     std::filesystem::path in_file{};
     parser.add_positional_option(in_file, "input");
 
+    size_t threads{1};
+    parser.add_option(threads, '\0', "threads", "number of threads, bam blocks are decompressed and records counted in parallel");
+
+    std::filesystem::path jsonFile{};
+    parser.add_option(jsonFile, '\0', "json", "additionally write a report (mapq, insert sizes, mismatches by read position, coverage per reference) as json to this file");
+
+    double sample{};
+    parser.add_option(sample, '\0', "sample", "estimate the statistics from about this fraction (e.g. 0.01) of a bam file, read as randomly placed segments");
+
+    uint64_t seed{};
+    parser.add_option(seed, '\0', "seed", "(sample) seed choosing the segments");
+
     try {
          parser.parse();
+         threads = std::max<size_t>(1, threads);
+         if (sample != 0 && (sample < 0 || sample >= 1 || !isBamFile(in_file) || !jsonFile.empty())) {
+             throw seqan3::argument_parser_error{"--sample requires a bam input, a fraction in (0, 1) and no --json"};
+         }
+         if (!jsonFile.empty() && !isBamFile(in_file) && !isSamFile(in_file)) {
+             throw seqan3::argument_parser_error{"--json requires a sam or bam input"};
+         }
     } catch (seqan3::argument_parser_error const& ext) {
         seqan3::debug_stream << "Parsing error. " << ext.what() << "\n";
         return EXIT_FAILURE;
     }
 
+    if (sample > 0) {
+        try {
+            printEstimates(sampleStats(in_file, sample, threads, seed));
+        } catch (std::runtime_error const& e) {
+            seqan3::debug_stream << e.what() << "\n";
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
+    }
 
-    auto fin  = seqan3::sam_file_input{in_file};
-
-    auto map = std::map<size_t, size_t>{};
-
-    auto cigarCt = std::unordered_map<char, size_t>{};
-
-    size_t seqCt{};
-    size_t charCt{};
-    for (auto & record : fin) {
-        seqCt += 1;
-        size_t countErrors{};
-        for (auto [ct, op] : record.cigar_sequence()) {
-            if (op.to_char() != 'M' && op.to_char() != '=') {
-                countErrors += ct;
+    auto stats      = SamStats{};
+    auto references = std::vector<std::pair<std::string, uint64_t>>{};
+    // broken input (not sam or bam, truncated or corrupt blocks) is reported instead of terminating
+    try {
+        if (isBamFile(in_file)) {
+            auto fin = BamReader{in_file, threads};
+            for (auto const& r : fin.header.references) {
+                references.emplace_back(r.name, r.length);
+            }
+            stats = collectStats(fin, threads, references.size(), !jsonFile.empty(), [](BamRecord const& record) {
+                auto md = record.tag("MD");
+                return RecordInfo{record.flag(), record.mapq(), record.refId(), record.templateLength(),
+                                  md && md->first == 'Z' ? md->second : std::string_view{}};
+            });
+        } else if (isSamFile(in_file)) {
+            auto fin   = SamReader{in_file};
+            references = samReferences(fin.header);
+            auto refIds = std::unordered_map<std::string_view, int64_t>{};
+            for (size_t i{0}; i < references.size(); ++i) {
+                refIds.try_emplace(references[i].first, i);
+            }
+            stats = collectStats(fin, threads, references.size(), !jsonFile.empty(), [&](SamRecord const& record) {
+                auto number = [](std::string_view s) {
+                    int64_t v{};
+                    std::from_chars(s.data(), s.data() + s.size(), v);
+                    return v;
+                };
+                auto ref = refIds.find(record.field(2));
+                auto md  = record.tag("MD");
+                return RecordInfo{static_cast<uint16_t>(number(record.field(1))), static_cast<uint8_t>(number(record.field(4))),
+                                  ref != refIds.end() ? ref->second : -1, number(record.field(8)),
+                                  md && md->first == 'Z' ? md->second : std::string_view{}};
+            });
+        } else {
+            auto fin = seqan3::sam_file_input{in_file};
+            for (auto & record : fin) {
+                stats.add([&](auto&& cb) {
+                    for (auto [ct, op] : record.cigar_sequence()) {
+                        cb(ct, op.to_char());
+                    }
+                });
             }
-            charCt += ct;
-            cigarCt[op.to_char()] += ct;
         }
-        map[countErrors] += 1;
+    } catch (std::runtime_error const& e) {
+        seqan3::debug_stream << e.what() << "\n";
+        return EXIT_FAILURE;
     }
 
     std::cout << "by error count:\n";
-    for (auto [error, count] : map) {
-        std::cout << count << " reads with " << error << " errors" << "\n";
+    for (size_t error{0}; error < stats.byErrors.size(); ++error) {
+        if (stats.byErrors[error] == 0) continue;
+        std::cout << stats.byErrors[error] << " reads with " << error << " errors" << "\n";
     }
     std::cout << "\nby type\n";
-    for (auto [c, ct] : cigarCt) {
-        std::cout << c << " occurred " << ct << " times, that is " << 1.0*ct/seqCt << " per read or " << 1.0*ct/charCt << " per base\n";
+    for (size_t c{0}; c < stats.byOperation.size(); ++c) {
+        auto ct = stats.byOperation[c];
+        if (ct == 0) continue;
+        std::cout << char(c) << " occurred " << ct << " times, that is " << 1.0*ct/stats.records << " per read or " << 1.0*ct/stats.bases << " per base\n";
     }
 
+    if (!jsonFile.empty()) {
+        try {
+            writeJson(jsonFile, stats, references);
+        } catch (std::runtime_error const& e) {
+            seqan3::debug_stream << e.what() << "\n";
+            return EXIT_FAILURE;
+        }
+    }
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,423 @@
+// SPDX-FileCopyrightText: 2006-2023, Knut Reinert & Freie Universität Berlin
+// SPDX-FileCopyrightText: 2016-2023, Knut Reinert & MPI für molekulare Genetik
+// SPDX-License-Identifier: BSD-3-Clause
+
+#pragma once
+
+#include "Bam.h"
+#include "Sam.h"
+
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <limits>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <variant>
+#include <vector>
+
+/** number of errors and specific errors of an alignment, as counted from its CIGAR */
+struct CigarCounts {
+    size_t errors{};
+    size_t mismatches{};
+    size_t insertions{};
+    size_t deletions{};
+    size_t clips{};
+    size_t referenceLength{}; // number of reference bases covered by the alignment
+
+    void add(size_t ct, char op) {
+        if (op != 'M' && op != '=') {
+            errors += ct;
+        }
+        if (op == 'X') {
+            mismatches += ct;
+        } else if (op == 'I') {
+            insertions += ct;
+        } else if (op == 'D') {
+            deletions += ct;
+        } else if (op == 'S' || op == 'H') {
+            clips += ct;
+        }
+        if (op == 'M' || op == 'D' || op == 'N' || op == '=' || op == 'X') {
+            referenceLength += ct;
+        }
+    }
+};
+
+/** counts the CIGAR of a raw BAM or SAM record, nothing else of the record is decoded */
+template <typename Record>
+auto countCigar(Record const& record) -> CigarCounts {
+    auto counts = CigarCounts{};
+    record.forEachCigar([&](size_t ct, char op) {
+        counts.add(ct, op);
+    });
+    return counts;
+}
+
+/** value of a filter (sub)expression, monostate if a field is missing */
+using FilterValue = std::variant<std::monostate, int64_t, double, std::string_view>;
+
+/** What a filter expression can look at for a single record */
+struct AlignmentFields {
+    CigarCounts      cigar;
+    int64_t          flag{};
+    int64_t          mapq{};
+    int64_t          pos{};  // 1-based leftmost reference position, 0 if unmapped
+    std::string_view ref;    // "*" if unmapped
+    void const*      record{};
+    auto           (*tag)(void const* record, std::string_view key) -> FilterValue{};
+
+    /** 1-based last reference position covered by the alignment */
+    auto end() const -> int64_t {
+        return pos + std::max<int64_t>(1, cigar.referenceLength) - 1;
+    }
+
+    static auto of(BamRecord const& record, BamHeader const& header) -> AlignmentFields {
+        auto refId = record.refId();
+        return {countCigar(record), record.flag(), record.mapq(), int64_t{record.pos()} + 1,
+                refId >= 0 && static_cast<size_t>(refId) < header.references.size() ? std::string_view{header.references[refId].name} : "*",
+                &record, &bamTag};
+    }
+
+    static auto of(SamRecord const& record) -> AlignmentFields {
+        auto number = [](std::string_view s) {
+            int64_t v{};
+            std::from_chars(s.data(), s.data() + s.size(), v);
+            return v;
+        };
+        return {countCigar(record), number(record.field(1)), number(record.field(4)), number(record.field(3)),
+                record.field(2), &record, &samTag};
+    }
+
+private:
+    static auto bamTag(void const* record, std::string_view key) -> FilterValue {
+        auto t = static_cast<BamRecord const*>(record)->tag(key);
+        if (!t) return {};
+        auto v = t->second.data();
+        switch (t->first) {
+        case 'c': return int64_t{loadLE<int8_t>(v)};
+        case 'C': return int64_t{loadLE<uint8_t>(v)};
+        case 's': return int64_t{loadLE<int16_t>(v)};
+        case 'S': return int64_t{loadLE<uint16_t>(v)};
+        case 'i': return int64_t{loadLE<int32_t>(v)};
+        case 'I': return int64_t{loadLE<uint32_t>(v)};
+        case 'f': return double{loadLE<float>(v)};
+        case 'A': case 'Z': return t->second;
+        }
+        return {};
+    }
+
+    static auto samTag(void const* record, std::string_view key) -> FilterValue {
+        auto t = static_cast<SamRecord const*>(record)->tag(key);
+        if (!t) return {};
+        auto text = t->second;
+        switch (t->first) {
+        case 'i': {
+            int64_t v{};
+            auto [ptr, ec] = std::from_chars(text.data(), text.data() + text.size(), v);
+            if (ec != std::errc{}) return {};
+            return v;
+        }
+        case 'f': return std::strtod(std::string{text}.c_str(), nullptr);
+        case 'A': case 'Z': return text;
+        }
+        return {};
+    }
+};
+
+/** A filter expression, compiled once into a tree of closures
+ *
+ * Grammar, with the usual precedence (lowest first):
+ *   expr    := and ('||' and)*
+ *   and     := cmp ('&&' cmp)*
+ *   cmp     := sum (('=='|'!='|'<'|'<='|'>'|'>=') sum)?
+ *   sum     := unary (('+'|'-'|'&') unary)*
+ *   unary   := '!' unary | '-' unary | primary
+ *   primary := number | "string" | field | 'tag.XX' | 'region("chr:begin-end")' | name | '(' expr ')'
+ *
+ * Fields: errors, mismatches, insertions, deletions, clips, flag, mapq,
+ * pos, end, ref and the flag bits paired, proper, unmapped, reverse,
+ * secondary, qcfail, duplicate, supplementary. name refers to a filter
+ * given to compile() as definition. Comparisons with missing values
+ * (e.g. absent tags) are false.
+ */
+struct AlignmentFilter {
+    using Fn = std::function<FilterValue(AlignmentFields const&)>;
+
+    Fn fn;
+
+    bool operator()(AlignmentFields const& fields) const {
+        return truthy(fn(fields));
+    }
+
+    static auto compile(std::string_view expr, std::map<std::string, AlignmentFilter, std::less<>> const& definitions = {}) -> AlignmentFilter {
+        auto parser = Parser{expr, definitions};
+        auto fn = parser.parseOr();
+        parser.skipSpace();
+        if (parser.pos != expr.size()) {
+            parser.fail("unexpected input");
+        }
+        return {std::move(fn)};
+    }
+
+    static bool truthy(FilterValue const& v) {
+        return std::visit([](auto const& x) {
+            using T = std::decay_t<decltype(x)>;
+            if constexpr (std::is_same_v<T, std::monostate>) return false;
+            else if constexpr (std::is_same_v<T, std::string_view>) return !x.empty();
+            else return x != 0;
+        }, v);
+    }
+
+private:
+    struct Parser {
+        std::string_view expr;
+        std::map<std::string, AlignmentFilter, std::less<>> const& definitions;
+        size_t pos{};
+
+        [[noreturn]] void fail(std::string const& msg) const {
+            throw std::invalid_argument("filter expression, " + msg + " at position " + std::to_string(pos) + ": " + std::string{expr});
+        }
+
+        void skipSpace() {
+            while (pos < expr.size() && std::isspace(static_cast<unsigned char>(expr[pos]))) ++pos;
+        }
+
+        bool accept(std::string_view token) {
+            skipSpace();
+            if (expr.substr(pos, token.size()) != token) return false;
+            pos += token.size();
+            return true;
+        }
+
+        void expect(std::string_view token) {
+            if (!accept(token)) fail("expected '" + std::string{token} + "'");
+        }
+
+        auto parseOr() -> Fn {
+            auto lhs = parseAnd();
+            while (accept("||")) {
+                auto rhs = parseAnd();
+                lhs = [lhs, rhs](AlignmentFields const& f) -> FilterValue {
+                    return int64_t{truthy(lhs(f)) || truthy(rhs(f))};
+                };
+            }
+            return lhs;
+        }
+
+        auto parseAnd() -> Fn {
+            auto lhs = parseCmp();
+            while (accept("&&")) {
+                auto rhs = parseCmp();
+                lhs = [lhs, rhs](AlignmentFields const& f) -> FilterValue {
+                    return int64_t{truthy(lhs(f)) && truthy(rhs(f))};
+                };
+            }
+            return lhs;
+        }
+
+        auto parseCmp() -> Fn {
+            auto lhs = parseSum();
+            for (auto op : {"==", "!=", "<=", ">=", "<", ">"}) {
+                if (accept(op)) {
+                    auto rhs = parseSum();
+                    return compare(std::string_view{op}, lhs, rhs);
+                }
+            }
+            return lhs;
+        }
+
+        auto parseSum() -> Fn {
+            auto lhs = parseUnary();
+            while (true) {
+                skipSpace();
+                if (expr.substr(pos, 2) == "&&") return lhs;
+                auto op = pos < expr.size() ? expr[pos] : '\0';
+                if (op != '+' && op != '-' && op != '&') return lhs;
+                ++pos;
+                auto rhs = parseUnary();
+                switch (op) {
+                case '+': lhs = arithmetic(lhs, rhs, std::plus<>{}); break;
+                case '-': lhs = arithmetic(lhs, rhs, std::minus<>{}); break;
+                default:  lhs = arithmetic(lhs, rhs, std::bit_and<>{}); break;
+                }
+            }
+        }
+
+        auto parseUnary() -> Fn {
+            if (accept("!")) {
+                auto v = parseUnary();
+                return [v](AlignmentFields const& f) -> FilterValue { return int64_t{!truthy(v(f))}; };
+            }
+            if (accept("-")) {
+                auto v = parseUnary();
+                return [v](AlignmentFields const& f) -> FilterValue {
+                    auto x = v(f);
+                    if (auto i = std::get_if<int64_t>(&x)) return -*i;
+                    if (auto d = std::get_if<double>(&x)) return -*d;
+                    return {};
+                };
+            }
+            return parsePrimary();
+        }
+
+        auto parsePrimary() -> Fn {
+            skipSpace();
+            if (accept("(")) {
+                auto v = parseOr();
+                expect(")");
+                return v;
+            }
+            if (pos < expr.size() && expr[pos] == '"') {
+                auto value = std::make_shared<std::string>(parseString());
+                return [value](AlignmentFields const&) -> FilterValue { return std::string_view{*value}; };
+            }
+            if (pos < expr.size() && std::isdigit(static_cast<unsigned char>(expr[pos]))) {
+                return parseNumber();
+            }
+            auto name = parseIdentifier();
+            if (name.starts_with("tag.")) {
+                auto key = name.substr(4);
+                if (key.size() != 2) fail("tags have two characters");
+                auto k = std::make_shared<std::string>(key);
+                return [k](AlignmentFields const& f) { return f.tag(f.record, *k); };
+            }
+            if (name == "region") {
+                expect("(");
+                skipSpace();
+                if (pos >= expr.size() || expr[pos] != '"') fail("expected region string");
+                auto region = std::make_shared<Region>(Region::parse(parseString()));
+                expect(")");
+                return [region](AlignmentFields const& f) -> FilterValue {
+                    return int64_t{f.ref == region->ref && f.pos <= region->end && f.end() >= region->begin};
+                };
+            }
+            if (auto fn = field(name)) {
+                return fn;
+            }
+            if (auto iter = definitions.find(name); iter != definitions.end()) {
+                return iter->second.fn;
+            }
+            fail("unknown name '" + std::string{name} + "'");
+        }
+
+        auto parseString() -> std::string {
+            auto value = std::string{};
+            ++pos; // opening quote
+            while (pos < expr.size() && expr[pos] != '"') {
+                if (expr[pos] == '\\' && pos + 1 < expr.size()) ++pos;
+                value += expr[pos++];
+            }
+            if (pos == expr.size()) fail("unterminated string");
+            ++pos;
+            return value;
+        }
+
+        auto parseNumber() -> Fn {
+            auto begin = pos;
+            while (pos < expr.size() && (std::isdigit(static_cast<unsigned char>(expr[pos])) || expr[pos] == '.')) ++pos;
+            auto text = std::string{expr.substr(begin, pos - begin)};
+            if (text.find('.') != std::string::npos) {
+                auto v = std::strtod(text.c_str(), nullptr);
+                return [v](AlignmentFields const&) -> FilterValue { return v; };
+            }
+            int64_t v{};
+            auto [ptr, ec] = std::from_chars(text.data(), text.data() + text.size(), v);
+            if (ec != std::errc{}) fail("invalid number");
+            return [v](AlignmentFields const&) -> FilterValue { return v; };
+        }
+
+        auto parseIdentifier() -> std::string_view {
+            auto begin = pos;
+            while (pos < expr.size() && (std::isalnum(static_cast<unsigned char>(expr[pos])) || expr[pos] == '_' || expr[pos] == '.')) ++pos;
+            if (begin == pos) fail("expected a value");
+            return expr.substr(begin, pos - begin);
+        }
+
+        static auto field(std::string_view name) -> Fn {
+            auto count = [](size_t CigarCounts::* member) -> Fn {
+                return [member](AlignmentFields const& f) -> FilterValue { return static_cast<int64_t>(f.cigar.*member); };
+            };
+            auto bit = [](int64_t mask) -> Fn {
+                return [mask](AlignmentFields const& f) -> FilterValue { return int64_t{(f.flag & mask) != 0}; };
+            };
+            if (name == "errors")        return count(&CigarCounts::errors);
+            if (name == "mismatches")    return count(&CigarCounts::mismatches);
+            if (name == "insertions")    return count(&CigarCounts::insertions);
+            if (name == "deletions")     return count(&CigarCounts::deletions);
+            if (name == "clips")         return count(&CigarCounts::clips);
+            if (name == "flag")          return [](AlignmentFields const& f) -> FilterValue { return f.flag; };
+            if (name == "mapq")          return [](AlignmentFields const& f) -> FilterValue { return f.mapq; };
+            if (name == "pos")           return [](AlignmentFields const& f) -> FilterValue { return f.pos; };
+            if (name == "end")           return [](AlignmentFields const& f) -> FilterValue { return f.end(); };
+            if (name == "ref")           return [](AlignmentFields const& f) -> FilterValue { return f.ref; };
+            if (name == "paired")        return bit(0x1);
+            if (name == "proper")        return bit(0x2);
+            if (name == "unmapped")      return bit(0x4);
+            if (name == "reverse")       return bit(0x10);
+            if (name == "secondary")     return bit(0x100);
+            if (name == "qcfail")        return bit(0x200);
+            if (name == "duplicate")     return bit(0x400);
+            if (name == "supplementary") return bit(0x800);
+            return {};
+        }
+
+        static auto asDouble(FilterValue const& v) -> std::optional<double> {
+            if (auto i = std::get_if<int64_t>(&v)) return static_cast<double>(*i);
+            if (auto d = std::get_if<double>(&v)) return *d;
+            return std::nullopt;
+        }
+
+        /** the operator is chosen while parsing, the closure only evaluates it */
+        template <typename Op>
+        static auto arithmetic(Fn lhs, Fn rhs, Op op) -> Fn {
+            return [lhs, rhs, op](AlignmentFields const& f) -> FilterValue {
+                auto l = lhs(f);
+                auto r = rhs(f);
+                if (auto li = std::get_if<int64_t>(&l), ri = std::get_if<int64_t>(&r); li && ri) {
+                    return op(*li, *ri);
+                }
+                if constexpr (std::is_invocable_v<Op, double, double>) { // no '&' on floating point values
+                    auto ld = asDouble(l);
+                    auto rd = asDouble(r);
+                    if (ld && rd) return op(*ld, *rd);
+                }
+                return {};
+            };
+        }
+
+        static auto compare(std::string_view op, Fn lhs, Fn rhs) -> Fn {
+            if (op == "==") return compareWith(lhs, rhs, std::equal_to<>{});
+            if (op == "!=") return compareWith(lhs, rhs, std::not_equal_to<>{});
+            if (op == "<")  return compareWith(lhs, rhs, std::less<>{});
+            if (op == "<=") return compareWith(lhs, rhs, std::less_equal<>{});
+            if (op == ">")  return compareWith(lhs, rhs, std::greater<>{});
+            return compareWith(lhs, rhs, std::greater_equal<>{});
+        }
+
+        template <typename Test>
+        static auto compareWith(Fn lhs, Fn rhs, Test test) -> Fn {
+            return [lhs, rhs, test](AlignmentFields const& f) -> FilterValue {
+                auto l = lhs(f);
+                auto r = rhs(f);
+                if (auto li = std::get_if<int64_t>(&l), ri = std::get_if<int64_t>(&r); li && ri) {
+                    return int64_t{test(*li, *ri)};
+                }
+                if (auto ls = std::get_if<std::string_view>(&l), rs = std::get_if<std::string_view>(&r); ls && rs) {
+                    return int64_t{test(*ls, *rs)};
+                }
+                auto ld = asDouble(l);
+                auto rd = asDouble(r);
+                if (!ld || !rd) return int64_t{0};
+                return int64_t{test(*ld, *rd)};
+            };
+        }
+    };
+};
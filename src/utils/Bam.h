@@ -0,0 +1,316 @@
+// SPDX-FileCopyrightText: 2006-2023, Knut Reinert & Freie Universität Berlin
+// SPDX-FileCopyrightText: 2016-2023, Knut Reinert & MPI für molekulare Genetik
+// SPDX-License-Identifier: BSD-3-Clause
+
+#pragma once
+
+#include "Bgzf.h"
+
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <filesystem>
+#include <limits>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/** a reference range 'name:begin-end', 1-based and inclusive */
+struct Region {
+    std::string ref;
+    int64_t     begin{1};
+    int64_t     end{std::numeric_limits<int32_t>::max()};
+
+    /** parses 'chr', 'chr:begin' or 'chr:begin-end', thousands separators are allowed */
+    static auto parse(std::string_view text) -> Region {
+        auto region = Region{};
+        auto colon  = text.rfind(':');
+        region.ref  = text.substr(0, colon);
+        if (colon == std::string_view::npos) return region;
+
+        auto digits = std::string{};
+        for (auto c : text.substr(colon + 1)) {
+            if (c != ',') digits += c;
+        }
+        auto p   = digits.data();
+        auto end = digits.data() + digits.size();
+        auto [ptr, ec] = std::from_chars(p, end, region.begin);
+        if (ec == std::errc{} && ptr < end && *ptr == '-') {
+            auto [ptr2, ec2] = std::from_chars(ptr + 1, end, region.end);
+            ec  = ec2;
+            ptr = ptr2;
+        } else if (ec == std::errc{} && ptr == end) {
+            region.end = region.begin;
+        }
+        if (ec != std::errc{} || ptr != end || region.begin < 1 || region.end < region.begin) {
+            throw std::invalid_argument("invalid region: " + std::string{text});
+        }
+        return region;
+    }
+};
+
+/** CIGAR operations in the order of their BAM codes */
+inline constexpr auto bamCigarOps = std::string_view{"MIDNSHP=X"};
+
+/** View on a raw BAM record, including its leading block_size field
+ *
+ * Fields are decoded on access, nothing is copied.
+ */
+struct BamRecord {
+    std::string_view raw;
+
+    auto refId()      const -> int32_t  { return loadLE<int32_t>(raw.data() + 4); }
+    auto pos()        const -> int32_t  { return loadLE<int32_t>(raw.data() + 8); }
+    auto nameLength() const -> uint8_t  { return static_cast<uint8_t>(raw[12]); }
+    auto mapq()       const -> uint8_t  { return static_cast<uint8_t>(raw[13]); }
+    auto cigarCount() const -> uint16_t { return loadLE<uint16_t>(raw.data() + 16); }
+    auto flag()       const -> uint16_t { return loadLE<uint16_t>(raw.data() + 18); }
+    auto seqLength()  const -> int32_t  { return loadLE<int32_t>(raw.data() + 20); }
+    auto templateLength() const -> int32_t { return loadLE<int32_t>(raw.data() + 32); }
+
+    /** true if read name, CIGAR, sequence and qualities fit into raw, the accessors below rely on it */
+    auto isComplete() const -> bool {
+        return raw.size() >= 36 && nameLength() >= 1 && seqLength() >= 0
+            && seqOffset() + (size_t(seqLength()) + 1) / 2 + size_t(seqLength()) <= raw.size();
+    }
+
+    auto readName() const -> std::string_view {
+        return raw.substr(36, nameLength() - 1); // without trailing '\0'
+    }
+
+    /** length and operation (one of bamCigarOps) of the i-th CIGAR element */
+    auto cigar(size_t i) const -> std::pair<uint32_t, char> {
+        auto v = loadLE<uint32_t>(raw.data() + 36 + nameLength() + i * 4);
+        return {v >> 4, (v & 0xf) < bamCigarOps.size() ? bamCigarOps[v & 0xf] : '?'};
+    }
+
+    /** calls cb(length, operation) for every CIGAR element */
+    template <typename CB>
+    void forEachCigar(CB&& cb) const {
+        for (size_t i{0}, n{cigarCount()}; i < n; ++i) {
+            auto [ct, op] = cigar(i);
+            cb(ct, op);
+        }
+    }
+
+    /** number of reference bases covered by the alignment */
+    auto referenceLength() const -> int64_t {
+        int64_t length{};
+        forEachCigar([&](uint32_t ct, char op) {
+            if (op == 'M' || op == 'D' || op == 'N' || op == '=' || op == 'X') {
+                length += ct;
+            }
+        });
+        return length;
+    }
+
+    /** the read sequence as characters */
+    void sequence(std::string& out) const {
+        static constexpr auto codes = std::string_view{"=ACMGRSVTWYHKDBN"};
+        auto n = static_cast<size_t>(seqLength());
+        auto p = raw.data() + seqOffset();
+        out.resize(n);
+        for (size_t i{0}; i < n; ++i) {
+            auto byte = static_cast<uint8_t>(p[i / 2]);
+            out[i] = codes[i % 2 == 0 ? byte >> 4 : byte & 0xf];
+        }
+    }
+
+    /** type and value of an optional field, the value is in its binary encoding (without trailing '\0' for Z and H) */
+    auto tag(std::string_view key) const -> std::optional<std::pair<char, std::string_view>> {
+        auto rest = raw.substr(seqOffset() + (seqLength() + 1) / 2 + seqLength());
+        while (rest.size() >= 3) {
+            auto type = rest[2];
+            auto size = tagValueSize(type, rest.substr(3));
+            if (size > rest.size() - 3) throw std::runtime_error("corrupt BAM record, truncated tag");
+            if (rest.substr(0, 2) == key) {
+                return std::pair{type, rest.substr(3, (type == 'Z' || type == 'H') ? size - 1 : size)};
+            }
+            rest.remove_prefix(3 + size);
+        }
+        return std::nullopt;
+    }
+
+private:
+    auto seqOffset() const -> size_t {
+        return 36 + nameLength() + 4 * size_t{cigarCount()};
+    }
+
+    static auto tagValueSize(char type, std::string_view value) -> size_t {
+        auto elementSize = [](char t) -> size_t {
+            switch (t) {
+            case 'A': case 'c': case 'C': return 1;
+            case 's': case 'S': return 2;
+            case 'i': case 'I': case 'f': return 4;
+            }
+            throw std::runtime_error("corrupt BAM record, unknown tag type");
+        };
+        if (type == 'Z' || type == 'H') {
+            auto end = value.find('\0');
+            if (end == std::string_view::npos) throw std::runtime_error("corrupt BAM record, unterminated tag");
+            return end + 1;
+        }
+        if (type == 'B') {
+            if (value.size() < 5) throw std::runtime_error("corrupt BAM record, truncated tag");
+            return 5 + elementSize(value[0]) * loadLE<uint32_t>(value.data() + 1);
+        }
+        return elementSize(type);
+    }
+};
+
+/** true if data starts with a complete record that is consistent with the BAM layout */
+inline bool isBamRecordAt(std::string_view data, size_t refCount) {
+    if (data.size() < 36) return false;
+    auto size = size_t{loadLE<uint32_t>(data.data())} + 4;
+    if (size < 36 || size > data.size()) return false;
+    auto r        = BamRecord{data.substr(0, size)};
+    auto validRef = [&](int32_t id) { return id >= -1 && id < static_cast<int64_t>(refCount); };
+    if (!validRef(r.refId()) || !validRef(loadLE<int32_t>(data.data() + 24)) || r.pos() < -1
+        || loadLE<int32_t>(data.data() + 28) < -1 || !r.isComplete() || data[36 + r.nameLength() - 1] != '\0') {
+        return false;
+    }
+    return std::ranges::all_of(r.readName(), [](char c) { return c >= '!' && c <= '~'; });
+}
+
+/** offset of the first record in decompressed data that starts at an unknown position, npos if none is found
+ *
+ * A position is accepted if 'chain' consecutive records starting there are
+ * consistent, or all records up to the end of data.
+ */
+inline auto bamFindRecord(std::string_view data, size_t refCount, size_t chain = 4) -> size_t {
+    for (size_t p{0}; p + 36 <= data.size(); ++p) {
+        auto   q = p;
+        size_t n{0};
+        while (n < chain && isBamRecordAt(data.substr(q), refCount)) {
+            q += size_t{loadLE<uint32_t>(data.data() + q)} + 4;
+            n += 1;
+        }
+        if (n == chain || (n > 0 && q == data.size())) return p;
+    }
+    return std::string_view::npos;
+}
+
+/** Header of a BAM file, raw holds the complete encoded header */
+struct BamHeader {
+    struct Reference {
+        std::string name;
+        uint32_t    length{};
+    };
+
+    std::string            raw;
+    std::string            text;
+    std::vector<Reference> references;
+};
+
+/** Reads a BAM file as batches of raw records */
+struct BamReader {
+    using Record = BamRecord;
+
+    BgzfReader        bgzf;
+    std::vector<char> buffer;  // decompressed data not yet handed out, starting at pos
+    size_t            pos{};
+    BamHeader         header;
+
+    // start in buffer (negative if before the buffer) and file offset of the blocks the buffer consists of
+    std::vector<std::pair<int64_t, uint64_t>> blocks;
+
+    explicit BamReader(std::filesystem::path const& file, size_t threads = 1)
+        : bgzf{file, threads}
+    {
+        readHeader();
+    }
+
+    /** next batch of complete records, views stay valid until the next call, false at the end */
+    bool next(std::vector<BamRecord>& records) {
+        records.clear();
+        while (true) {
+            auto p   = buffer.data() + pos;
+            auto end = buffer.data() + buffer.size();
+            while (end - p >= 4) {
+                auto size = size_t{loadLE<uint32_t>(p)} + 4;
+                if (static_cast<size_t>(end - p) < size) break;
+                auto record = BamRecord{{p, size}};
+                if (!record.isComplete()) throw std::runtime_error("corrupt BAM record");
+                records.push_back(record);
+                p += size;
+            }
+            pos = p - buffer.data();
+            if (!records.empty()) return true;
+            if (!fill()) {
+                if (pos != buffer.size()) throw std::runtime_error("BAM input is truncated");
+                return false;
+            }
+        }
+    }
+
+    /** virtual offset (block file offset << 16 | offset in block) of a record of the current batch */
+    auto virtualOffset(BamRecord const& record) const -> uint64_t {
+        auto at   = static_cast<int64_t>(record.raw.data() - buffer.data());
+        auto iter = std::ranges::upper_bound(blocks, at, {}, [](auto const& b) { return b.first; });
+        --iter;
+        return iter->second << 16 | (at - iter->first);
+    }
+
+    /** continues reading at the given virtual offset, e.g. taken from an index */
+    void seek(uint64_t virtualOffset) {
+        bgzf.seek(virtualOffset >> 16);
+        buffer.clear();
+        blocks.clear();
+        pos = 0;
+        fill();
+        pos = std::min(buffer.size(), static_cast<size_t>(virtualOffset & 0xffff));
+    }
+
+private:
+    /** appends the next decompressed piece to the buffer, dropping what was handed out */
+    bool fill() {
+        buffer.erase(buffer.begin(), buffer.begin() + pos);
+        for (auto& b : blocks) {
+            b.first -= pos;
+        }
+        auto firstInBuffer = std::ranges::upper_bound(blocks, int64_t{0}, {}, [](auto const& b) { return b.first; });
+        if (firstInBuffer != blocks.begin()) {
+            blocks.erase(blocks.begin(), std::prev(firstInBuffer));
+        }
+        pos = 0;
+
+        auto data = bgzf.next();
+        for (size_t i{0}; i < bgzf.blockOffsets.size(); ++i) {
+            blocks.emplace_back(buffer.size() + bgzf.blockStarts[i], bgzf.blockOffsets[i]);
+        }
+        buffer.insert(buffer.end(), data.begin(), data.end());
+        return !data.empty();
+    }
+
+    auto take(size_t n) -> std::string_view {
+        while (buffer.size() - pos < n) {
+            if (!fill()) throw std::runtime_error("BAM header is truncated");
+        }
+        auto r = std::string_view{buffer.data() + pos, n};
+        header.raw += r;
+        pos += n;
+        return r;
+    }
+
+    void readHeader() {
+        if (take(4) != std::string_view{"BAM\1", 4}) {
+            throw std::runtime_error("input is not a BAM file");
+        }
+        auto textLength = loadLE<uint32_t>(take(4).data());
+        header.text     = take(textLength);
+        auto refCount   = loadLE<uint32_t>(take(4).data());
+        for (uint32_t i{0}; i < refCount; ++i) {
+            auto nameLength = loadLE<uint32_t>(take(4).data());
+            auto name       = take(nameLength);
+            auto length     = loadLE<uint32_t>(take(4).data());
+            header.references.push_back({std::string{name.substr(0, name.find('\0'))}, length});
+        }
+    }
+};
+
+/** true if the path names a BAM file */
+inline bool isBamFile(std::filesystem::path const& file) {
+    return file.extension() == ".bam";
+}
@@ -0,0 +1,456 @@
+// SPDX-FileCopyrightText: 2006-2023, Knut Reinert & Freie Universität Berlin
+// SPDX-FileCopyrightText: 2016-2023, Knut Reinert & MPI für molekulare Genetik
+// SPDX-License-Identifier: BSD-3-Clause
+
+#pragma once
+
+#include "Bam.h"
+#include "Bgzf.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/** Indices for coordinate sorted BAM files, compatible with samtools/htslib
+ *
+ * Records are assigned to bins of a hierarchical binning scheme, every bin
+ * lists the chunks (ranges of virtual offsets) holding its records. BAI
+ * uses 16kb windows (min_shift 14) and 6 levels (depth 5) and has an
+ * additional linear index. CSI stores min_shift and depth and keeps a
+ * smallest offset per bin instead of the linear index.
+ */
+struct BamChunk {
+    uint64_t begin{}; // virtual offsets
+    uint64_t end{};
+};
+
+/** smallest bin fully containing [beg, end), 0-based */
+inline auto reg2bin(int64_t beg, int64_t end, int minShift = 14, int depth = 5) -> uint32_t {
+    --end;
+    auto t = ((1 << depth * 3) - 1) / 7;
+    for (int l{depth}, s{minShift}; l > 0; --l, s += 3, t -= 1 << l * 3) {
+        if (beg >> s == end >> s) return t + (beg >> s);
+    }
+    return 0;
+}
+
+/** all bins overlapping [beg, end), 0-based */
+inline void reg2bins(int64_t beg, int64_t end, int minShift, int depth, std::vector<uint32_t>& bins) {
+    --end;
+    int64_t t{0};
+    for (int l{0}, s{minShift + depth * 3}; l <= depth; s -= 3, t += int64_t{1} << l * 3, ++l) {
+        for (auto b = t + (beg >> s); b <= t + (end >> s); ++b) {
+            bins.push_back(b);
+        }
+    }
+}
+
+/** id of the bin holding per reference meta data, one after the last regular bin */
+inline auto bamMetaBin(int depth) -> uint32_t {
+    return ((1 << (depth + 1) * 3) - 1) / 7 + 1;
+}
+
+/** A loaded .bai or .csi index */
+struct BamIndex {
+    struct Reference {
+        std::map<uint32_t, std::vector<BamChunk>> bins;
+        std::map<uint32_t, uint64_t>              loffsets; // csi only, smallest virtual offset per bin
+        std::vector<uint64_t>                     linear;   // bai only, smallest virtual offset per 16kb window
+    };
+
+    int                    minShift{14};
+    int                    depth{5};
+    std::vector<Reference> references;
+
+    /** loads a .bai or a (BGZF compressed) .csi file, the format is detected by its magic */
+    static auto load(std::filesystem::path const& file) -> BamIndex {
+        auto data = std::string{};
+        {
+            auto ifs = std::ifstream{file, std::ios::binary};
+            if (!ifs) throw std::runtime_error("can not open " + file.string());
+            data.assign(std::istreambuf_iterator<char>{ifs}, {});
+        }
+        if (data.size() >= 2 && data[0] == '\x1f' && data[1] == '\x8b') {
+            auto bgzf = BgzfReader{file};
+            data.clear();
+            for (auto piece = bgzf.next(); !piece.empty(); piece = bgzf.next()) {
+                data += piece;
+            }
+        }
+
+        auto rest = std::string_view{data};
+        auto take = [&]<typename T>(T) -> T {
+            if (rest.size() < sizeof(T)) {
+                throw std::runtime_error(file.string() + " is truncated");
+            }
+            auto v = loadLE<T>(rest.data());
+            rest.remove_prefix(sizeof(T));
+            return v;
+        };
+
+        auto index = BamIndex{};
+        auto magic = rest.substr(0, 4);
+        rest.remove_prefix(magic.size());
+        bool csi = magic == std::string_view{"CSI\1", 4};
+        if (!csi && magic != std::string_view{"BAI\1", 4}) {
+            throw std::runtime_error(file.string() + " is neither a bai nor a csi index");
+        }
+        if (csi) {
+            index.minShift = take(int32_t{});
+            index.depth    = take(int32_t{});
+            auto auxLength = take(int32_t{});
+            if (auxLength < 0 || rest.size() < size_t(auxLength)) {
+                throw std::runtime_error(file.string() + " is truncated");
+            }
+            rest.remove_prefix(auxLength);
+        }
+        auto metaBin = bamMetaBin(index.depth);
+        index.references.resize(take(int32_t{}));
+        for (auto& ref : index.references) {
+            auto binCount = take(int32_t{});
+            for (int32_t i{0}; i < binCount; ++i) {
+                auto bin     = take(uint32_t{});
+                auto loffset = csi ? take(uint64_t{}) : 0;
+                auto chunks  = std::vector<BamChunk>(take(int32_t{}));
+                for (auto& c : chunks) {
+                    c.begin = take(uint64_t{});
+                    c.end   = take(uint64_t{});
+                }
+                if (bin == metaBin) continue;
+                if (csi) ref.loffsets[bin] = loffset;
+                ref.bins[bin] = std::move(chunks);
+            }
+            if (!csi) {
+                ref.linear.resize(take(int32_t{}));
+                for (auto& o : ref.linear) {
+                    o = take(uint64_t{});
+                }
+            }
+        }
+        return index;
+    }
+
+    /** the index next to a bam file ('x.bam.bai', 'x.bam.csi' or 'x.bai'), if there is one */
+    static auto find(std::filesystem::path const& bamFile) -> std::optional<std::filesystem::path> {
+        for (auto candidate : {std::filesystem::path{bamFile.string() + ".bai"},
+                               std::filesystem::path{bamFile.string() + ".csi"},
+                               std::filesystem::path{bamFile}.replace_extension(".bai")}) {
+            if (std::filesystem::exists(candidate)) return candidate;
+        }
+        return std::nullopt;
+    }
+
+    /** sorted, non overlapping chunks that hold all records of reference tid overlapping [beg, end), 0-based */
+    auto chunks(int32_t tid, int64_t beg, int64_t end) const -> std::vector<BamChunk> {
+        if (tid < 0 || size_t(tid) >= references.size()) return {};
+        auto const& ref = references[tid];
+        end = std::min(end, int64_t{1} << (minShift + depth * 3));
+        if (beg >= end) return {};
+
+        // records starting before this offset can't overlap the region
+        uint64_t minOffset{0};
+        if (!ref.linear.empty()) {
+            minOffset = ref.linear[std::min(size_t(beg >> minShift), ref.linear.size() - 1)];
+        } else if (!ref.loffsets.empty()) {
+            auto bin = ((1 << depth * 3) - 1) / 7 + (beg >> minShift);
+            while (true) {
+                if (auto iter = ref.loffsets.find(bin); iter != ref.loffsets.end()) {
+                    minOffset = iter->second;
+                    break;
+                }
+                if (bin == 0) break;
+                bin = (bin - 1) >> 3;
+            }
+        }
+
+        auto bins = std::vector<uint32_t>{};
+        reg2bins(beg, end, minShift, depth, bins);
+        auto result = std::vector<BamChunk>{};
+        for (auto b : bins) {
+            auto iter = ref.bins.find(b);
+            if (iter == ref.bins.end()) continue;
+            for (auto const& c : iter->second) {
+                if (c.end > minOffset) result.push_back(c);
+            }
+        }
+        return mergeChunks(std::move(result));
+    }
+
+    /** sorts chunks and joins overlapping ones */
+    static auto mergeChunks(std::vector<BamChunk> chunks) -> std::vector<BamChunk> {
+        std::ranges::sort(chunks, {}, &BamChunk::begin);
+        auto merged = std::vector<BamChunk>{};
+        for (auto const& c : chunks) {
+            if (!merged.empty() && c.begin <= merged.back().end) {
+                merged.back().end = std::max(merged.back().end, c.end);
+            } else {
+                merged.push_back(c);
+            }
+        }
+        return merged;
+    }
+};
+
+/** Collects the index of a coordinate sorted BAM file while it is written, saved as .bai */
+struct BamIndexBuilder {
+    struct Reference {
+        std::map<uint32_t, std::vector<BamChunk>> bins;
+        std::vector<uint64_t>                     linear;
+        std::optional<BamChunk>                   span; // offsets of the first and behind the last record
+        uint64_t                                  mapped{};
+        uint64_t                                  unmapped{};
+    };
+
+    static constexpr int     minShift{14};
+    static constexpr int     depth{5};
+    static constexpr int64_t maxPosition{int64_t{1} << (minShift + depth * 3)};
+    static constexpr auto    unset = std::numeric_limits<uint64_t>::max();
+
+    std::vector<Reference> references;
+    uint64_t               noCoordinate{}; // records without reference
+    int32_t                lastTid{0};
+    int64_t                lastPos{-1};
+
+    explicit BamIndexBuilder(size_t referenceCount)
+        : references(referenceCount)
+    {}
+
+    /** adds a record covering [beg, end) of reference tid, stored at virtual offsets [vbeg, vend) */
+    void add(int32_t tid, int64_t beg, int64_t end, bool unmapped, uint64_t vbeg, uint64_t vend) {
+        if (tid < 0) {
+            lastTid = -1;
+            noCoordinate += 1;
+            return;
+        }
+        if (lastTid == -1 || tid < lastTid || (tid == lastTid && beg < lastPos)) {
+            throw std::runtime_error("can not index unsorted output, records must be sorted by coordinate");
+        }
+        if (size_t(tid) >= references.size()) {
+            throw std::runtime_error("record refers to an unknown reference");
+        }
+        if (end > maxPosition) {
+            throw std::runtime_error("can not index positions beyond 2^29 in a bai index");
+        }
+        beg     = std::max<int64_t>(beg, 0);
+        end     = std::max(end, beg + 1);
+        lastTid = tid;
+        lastPos = beg;
+
+        auto& ref    = references[tid];
+        auto& chunks = ref.bins[reg2bin(beg, end, minShift, depth)];
+        // Contiguous records and records starting in the block the last chunk ends in extend that chunk,
+        // which is the merge htslib does when it finishes an index. htslib additionally moves the chunks
+        // of small bins into their parent bin; that is not done here, both give valid indices.
+        if (!chunks.empty() && (chunks.back().end == vbeg || chunks.back().end >> 16 == vbeg >> 16)) {
+            chunks.back().end = vend;
+        } else {
+            chunks.push_back({vbeg, vend});
+        }
+
+        auto lastWindow = size_t((end - 1) >> minShift);
+        if (ref.linear.size() <= lastWindow) {
+            ref.linear.resize(lastWindow + 1, unset);
+        }
+        for (auto w = size_t(beg >> minShift); w <= lastWindow; ++w) {
+            if (ref.linear[w] == unset) ref.linear[w] = vbeg;
+        }
+
+        if (!ref.span) ref.span = BamChunk{vbeg, vend};
+        ref.span->end = vend;
+        (unmapped ? ref.unmapped : ref.mapped) += 1;
+    }
+
+    void save(std::filesystem::path const& file) {
+        auto out = std::string{"BAI\1"};
+        auto put = [&]<typename T>(T v) {
+            out.resize(out.size() + sizeof(T));
+            storeLE(out.data() + out.size() - sizeof(T), v);
+        };
+        put(int32_t(references.size()));
+        for (auto& ref : references) {
+            put(int32_t(ref.bins.size() + (ref.span ? 1 : 0)));
+            for (auto const& [bin, chunks] : ref.bins) {
+                put(bin);
+                put(int32_t(chunks.size()));
+                for (auto const& c : chunks) {
+                    put(c.begin);
+                    put(c.end);
+                }
+            }
+            if (ref.span) {
+                put(bamMetaBin(depth));
+                put(int32_t{2});
+                put(ref.span->begin);
+                put(ref.span->end);
+                put(ref.mapped);
+                put(ref.unmapped);
+            }
+            // windows without records start at the previous record
+            put(int32_t(ref.linear.size()));
+            uint64_t previous{0};
+            for (auto o : ref.linear) {
+                previous = o == unset ? previous : o;
+                put(previous);
+            }
+        }
+        put(noCoordinate);
+
+        auto ofs = std::ofstream{file, std::ios::binary};
+        if (!ofs.write(out.data(), out.size())) {
+            throw std::runtime_error("failed writing " + file.string());
+        }
+    }
+};
+
+/** Writes a BAM file, optionally collecting a .bai index on the fly
+ *
+ * The virtual offset of a record is only known once its block has been
+ * compressed, so records wait in a queue until then.
+ */
+struct BamWriter {
+    struct Pending {
+        int32_t  tid;
+        int64_t  beg;
+        int64_t  end;
+        bool     unmapped;
+        uint64_t ubeg; // uncompressed positions in the output
+        uint64_t uend;
+    };
+
+    BgzfWriter                     bgzf;
+    std::optional<BamIndexBuilder> index;
+    std::deque<Pending>            pending;
+
+    BamWriter(std::filesystem::path const& file, BamHeader const& header, size_t threads = 1, bool buildIndex = false)
+        : bgzf{file, threads}
+    {
+        bgzf.trackBlocks = buildIndex;
+        bgzf.write(header.raw);
+        if (buildIndex) {
+            index.emplace(header.references.size());
+        }
+    }
+
+    void write(BamRecord const& record) {
+        auto ubeg = bgzf.position();
+        bgzf.write(record.raw);
+        if (!index) return;
+        bool unmapped = record.flag() & 0x4;
+        auto end      = record.pos() + (unmapped ? 1 : std::max<int64_t>(1, record.referenceLength()));
+        pending.push_back({record.refId(), record.pos(), end, unmapped, ubeg, bgzf.position()});
+        resolve();
+    }
+
+    /** finishes the file, the index is written to indexFile if it was collected */
+    void close(std::filesystem::path const& indexFile = {}) {
+        bgzf.flush();
+        resolve();
+        bgzf.close();
+        if (index && !indexFile.empty()) {
+            index->save(indexFile);
+        }
+    }
+
+private:
+    void resolve() {
+        while (!pending.empty() && pending.front().uend <= bgzf.compressed) {
+            auto const& p = pending.front();
+            index->add(p.tid, p.beg, p.end, p.unmapped, bgzf.virtualOffset(p.ubeg), bgzf.virtualOffset(p.uend));
+            pending.pop_front();
+        }
+        bgzf.forgetBlocksBefore(pending.empty() ? bgzf.compressed : pending.front().ubeg);
+    }
+};
+
+/** Reads only the records of a BAM file overlapping some regions, using its index
+ *
+ * Records are reported in file order, each at most once.
+ */
+struct BamRegionReader {
+    using Record = BamRecord;
+
+    struct Interval {
+        int32_t tid;
+        int64_t beg; // 0-based, half open
+        int64_t end;
+    };
+
+    BamReader&             in;
+    std::vector<Interval>  intervals;
+    std::vector<BamChunk>  chunks;
+    size_t                 chunk{};
+    bool                   seeked{false};
+    std::vector<BamRecord> batch;
+    size_t                 batchPos{}; // first record of batch not looked at yet
+
+    BamRegionReader(BamReader& in_, BamIndex const& index, std::vector<Region> const& regions)
+        : in{in_}
+    {
+        auto const& refs = in.header.references;
+        for (auto const& r : regions) {
+            auto iter = std::ranges::find(refs, r.ref, &BamHeader::Reference::name);
+            if (iter == refs.end()) {
+                throw std::invalid_argument("unknown reference in region: " + r.ref);
+            }
+            auto tid = int32_t(iter - refs.begin());
+            intervals.push_back({tid, r.begin - 1, r.end});
+            auto c = index.chunks(tid, r.begin - 1, r.end);
+            chunks.insert(chunks.end(), c.begin(), c.end());
+        }
+        chunks = BamIndex::mergeChunks(std::move(chunks));
+    }
+
+    /** next batch of overlapping records, views stay valid until the next call, false at the end */
+    bool next(std::vector<BamRecord>& records) {
+        records.clear();
+        while (chunk < chunks.size()) {
+            if (batchPos == batch.size()) {
+                if (!seeked) {
+                    in.seek(chunks[chunk].begin);
+                    seeked = true;
+                }
+                batchPos = 0;
+                if (!in.next(batch)) break; // the remaining chunks are behind the end of the file
+            }
+            while (batchPos < batch.size() && chunk < chunks.size()) {
+                auto const& r = batch[batchPos];
+                auto offset   = in.virtualOffset(r);
+                if (offset >= chunks[chunk].end) {
+                    // a following chunk that starts inside the current batch is read from it, others are seeked to
+                    chunk += 1;
+                    if (chunk < chunks.size() && chunks[chunk].begin > in.virtualOffset(batch.back())) {
+                        seeked   = false;
+                        batchPos = batch.size();
+                    }
+                    continue;
+                }
+                if (offset >= chunks[chunk].begin && overlaps(r)) {
+                    records.push_back(r);
+                }
+                batchPos += 1;
+            }
+            if (!records.empty()) return true;
+        }
+        return false;
+    }
+
+private:
+    bool overlaps(BamRecord const& r) const {
+        auto tid = r.refId();
+        auto beg = int64_t{r.pos()};
+        auto end = beg + std::max<int64_t>(1, (r.flag() & 0x4) ? 0 : r.referenceLength());
+        return std::ranges::any_of(intervals, [&](Interval const& i) {
+            return i.tid == tid && beg < i.end && end > i.beg;
+        });
+    }
+};
@@ -0,0 +1,365 @@
+// SPDX-FileCopyrightText: 2006-2023, Knut Reinert & Freie Universität Berlin
+// SPDX-FileCopyrightText: 2016-2023, Knut Reinert & MPI für molekulare Genetik
+// SPDX-License-Identifier: BSD-3-Clause
+
+#pragma once
+
+#include "ParallelFor.h"
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <numeric>
+#include <stdexcept>
+#include <string_view>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+
+/** BGZF, the blocked gzip format used by BAM
+ *
+ * A BGZF file is a series of gzip members of at most 64KiB each. The
+ * compressed size of every member is stored in a gzip extra field, so
+ * blocks can be located without decompressing them and (de)compressed
+ * independently of each other, which is what the reader and writer below
+ * do in parallel.
+ */
+inline constexpr size_t bgzfMaxBlockSize = 1ul << 16;
+inline constexpr size_t bgzfBlockPayload = 0xff00; // uncompressed bytes per block, as htslib does it
+inline constexpr size_t bgzfHeaderSize   = 18;
+inline constexpr size_t bgzfFooterSize   = 8;
+
+/** the empty block marking the end of a BGZF file */
+inline constexpr auto bgzfEofBlock = std::array<uint8_t, 28>{
+    0x1f, 0x8b, 0x08, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0x06, 0x00, 0x42, 0x43,
+    0x02, 0x00, 0x1b, 0x00, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
+
+template <typename T>
+auto loadLE(char const* p) -> T {
+    T v;
+    std::memcpy(&v, p, sizeof(T));
+    return v;
+}
+
+template <typename T>
+void storeLE(char* p, T v) {
+    std::memcpy(p, &v, sizeof(T));
+}
+
+/** size of the block at the start of data, 0 if data is too short to tell, throws if it isn't a BGZF block */
+inline auto bgzfBlockSize(std::string_view data) -> size_t {
+    if (data.size() < 12) return 0;
+    auto u = reinterpret_cast<uint8_t const*>(data.data());
+    if (u[0] != 0x1f || u[1] != 0x8b || u[2] != 0x08 || !(u[3] & 0x04)) {
+        throw std::runtime_error("input is not BGZF compressed");
+    }
+    auto xlen = size_t{loadLE<uint16_t>(data.data() + 10)};
+    if (data.size() < 12 + xlen) return 0;
+    for (size_t i{12}; i + 4 <= 12 + xlen; i += 4 + loadLE<uint16_t>(data.data() + i + 2)) {
+        if (u[i] == 'B' && u[i+1] == 'C' && loadLE<uint16_t>(data.data() + i + 2) == 2 && i + 6 <= 12 + xlen) {
+            return size_t{loadLE<uint16_t>(data.data() + i + 4)} + 1;
+        }
+    }
+    throw std::runtime_error("gzip block without BGZF size field");
+}
+
+/** offset of the first block starting at or after 'from', data.size() if there is none
+ *
+ * Used to jump into the middle of a file: a candidate header only counts if
+ * the data behind the block ends there or starts with another header.
+ */
+inline auto bgzfFindBlock(std::string_view data, size_t from) -> size_t {
+    auto u          = reinterpret_cast<uint8_t const*>(data.data());
+    auto headerAt   = [&](size_t p) {
+        return p + bgzfHeaderSize <= data.size()
+            && u[p] == 0x1f && u[p+1] == 0x8b && u[p+2] == 0x08 && u[p+3] == 0x04
+            && loadLE<uint16_t>(data.data() + p + 10) == 6
+            && u[p+12] == 'B' && u[p+13] == 'C' && loadLE<uint16_t>(data.data() + p + 14) == 2;
+    };
+    for (auto p = from; p < data.size(); ++p) {
+        auto next = static_cast<char const*>(std::memchr(data.data() + p, 0x1f, data.size() - p));
+        if (!next) break;
+        p = next - data.data();
+        if (!headerAt(p)) continue;
+        auto end = p + loadLE<uint16_t>(data.data() + p + 16) + 1;
+        if (end == data.size() || headerAt(end)) return p;
+    }
+    return data.size();
+}
+
+/** uncompressed size of a complete block */
+inline auto bgzfUncompressedSize(std::string_view block) -> size_t {
+    return loadLE<uint32_t>(block.data() + block.size() - 4);
+}
+
+/** decompresses a complete block into out, which has room for bgzfUncompressedSize(block) bytes */
+inline void bgzfInflate(std::string_view block, char* out) {
+    auto xlen   = size_t{loadLE<uint16_t>(block.data() + 10)};
+    auto header = 12 + xlen;
+    auto crc    = loadLE<uint32_t>(block.data() + block.size() - 8);
+    auto isize  = bgzfUncompressedSize(block);
+
+    auto zs = z_stream{};
+    if (inflateInit2(&zs, -15) != Z_OK) {
+        throw std::runtime_error("can not initialize zlib");
+    }
+    zs.next_in   = reinterpret_cast<Bytef*>(const_cast<char*>(block.data() + header));
+    zs.avail_in  = block.size() - header - bgzfFooterSize;
+    zs.next_out  = reinterpret_cast<Bytef*>(out);
+    zs.avail_out = isize;
+    auto r = inflate(&zs, Z_FINISH);
+    inflateEnd(&zs);
+    if (r != Z_STREAM_END || zs.total_out != isize) {
+        throw std::runtime_error("corrupt BGZF block");
+    }
+    if (crc32(crc32(0, nullptr, 0), reinterpret_cast<Bytef const*>(out), isize) != crc) {
+        throw std::runtime_error("BGZF block with wrong checksum");
+    }
+}
+
+/** compresses at most bgzfBlockPayload bytes into a complete block, appended to out */
+inline void bgzfDeflate(std::string_view data, int level, std::vector<char>& out) {
+    auto start = out.size();
+    out.resize(start + bgzfMaxBlockSize);
+    auto p = out.data() + start;
+    std::memcpy(p, bgzfEofBlock.data(), bgzfHeaderSize);
+
+    auto zs = z_stream{};
+    if (deflateInit2(&zs, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        throw std::runtime_error("can not initialize zlib");
+    }
+    zs.next_in   = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+    zs.avail_in  = data.size();
+    zs.next_out  = reinterpret_cast<Bytef*>(p + bgzfHeaderSize);
+    zs.avail_out = bgzfMaxBlockSize - bgzfHeaderSize - bgzfFooterSize;
+    auto r = deflate(&zs, Z_FINISH);
+    deflateEnd(&zs);
+    if (r != Z_STREAM_END) {
+        throw std::runtime_error("BGZF block does not fit into 64KiB");
+    }
+    auto size = bgzfHeaderSize + zs.total_out + bgzfFooterSize;
+    storeLE<uint16_t>(p + 16, size - 1);
+    storeLE<uint32_t>(p + size - 8, crc32(crc32(0, nullptr, 0), reinterpret_cast<Bytef const*>(data.data()), data.size()));
+    storeLE<uint32_t>(p + size - 4, data.size());
+    out.resize(start + size);
+}
+
+/** Reads a BGZF file, many blocks at a time, decompressed in parallel */
+struct BgzfReader {
+    int               fd{-1};
+    size_t            threads{1};
+    size_t            batchBlocks{};
+    std::vector<char> raw;           // compressed input, starting at file offset rawOffset
+    size_t            rawEnd{};
+    uint64_t          rawOffset{};
+    bool              eof{false};
+    std::vector<char> data;          // decompressed blocks of the current batch
+
+    std::vector<uint64_t> blockOffsets; // file offset of every block of the current batch
+    std::vector<size_t>   blockStarts;  // start of every block in data, plus data.size()
+
+    explicit BgzfReader(std::filesystem::path const& file, size_t threads_ = 1)
+        : fd{::open(file.c_str(), O_RDONLY)}
+        , threads{std::max<size_t>(1, threads_)}
+        , batchBlocks{threads * 8}
+        , raw(batchBlocks * bgzfMaxBlockSize)
+    {
+        if (fd == -1) {
+            throw std::runtime_error("can not open " + file.string());
+        }
+    }
+    BgzfReader(BgzfReader const&) = delete;
+    auto operator=(BgzfReader const&) -> BgzfReader& = delete;
+    ~BgzfReader() {
+        ::close(fd);
+    }
+
+    /** continues reading at the block starting at the given file offset */
+    void seek(uint64_t fileOffset) {
+        if (::lseek(fd, fileOffset, SEEK_SET) == -1) {
+            throw std::runtime_error("can not seek in input");
+        }
+        rawEnd    = 0;
+        rawOffset = fileOffset;
+        eof       = false;
+        blockOffsets.clear();
+    }
+
+    /** next decompressed piece of the file, empty at the end */
+    auto next() -> std::string_view {
+        while (true) {
+            auto blocks = readBlocks();
+            if (blocks.empty()) return {};
+
+            blockStarts.assign(1, 0);
+            for (auto b : blocks) {
+                blockStarts.push_back(blockStarts.back() + bgzfUncompressedSize(b));
+            }
+            data.resize(blockStarts.back());
+            parallelFor(threads, blocks.size(), [&](size_t i, size_t) {
+                bgzfInflate(blocks[i], data.data() + blockStarts[i]);
+            });
+            if (!data.empty()) {
+                return {data.data(), data.size()};
+            }
+        }
+    }
+
+private:
+    /** next batch of complete compressed blocks, views into raw */
+    auto readBlocks() -> std::vector<std::string_view> {
+        // drop the blocks of the last batch
+        auto consumed = blockOffsets.empty() ? 0 : blockEnd - rawOffset;
+        std::memmove(raw.data(), raw.data() + consumed, rawEnd - consumed);
+        rawEnd    -= consumed;
+        rawOffset += consumed;
+        blockOffsets.clear();
+
+        while (!eof && rawEnd < raw.size()) {
+            auto r = ::read(fd, raw.data() + rawEnd, raw.size() - rawEnd);
+            if (r < 0) {
+                if (errno == EINTR) continue;
+                throw std::runtime_error("failed reading input");
+            }
+            if (r == 0) eof = true;
+            rawEnd += r;
+        }
+
+        auto blocks = std::vector<std::string_view>{};
+        auto rest   = std::string_view{raw.data(), rawEnd};
+        while (blocks.size() < batchBlocks && !rest.empty()) {
+            auto size = bgzfBlockSize(rest);
+            if (size == 0 || size > rest.size()) {
+                if (eof) throw std::runtime_error("input is truncated");
+                break;
+            }
+            blockOffsets.push_back(rawOffset + (rest.data() - raw.data()));
+            blocks.push_back(rest.substr(0, size));
+            rest.remove_prefix(size);
+        }
+        blockEnd = rawOffset + (rest.data() - raw.data());
+        return blocks;
+    }
+
+    uint64_t blockEnd{}; // file offset after the last block of the current batch
+};
+
+/** Writes a BGZF file, pending data is compressed in parallel, many blocks at a time */
+struct BgzfWriter {
+    int               fd{-1};
+    size_t            threads{1};
+    int               level{Z_DEFAULT_COMPRESSION};
+    size_t            batchSize{};
+    std::vector<char> pending;
+    uint64_t          written{};    // compressed bytes written so far
+    uint64_t          compressed{}; // uncompressed bytes that have been compressed and written
+
+    // uncompressed start and file offset of the written blocks, used to compute virtual offsets,
+    // only recorded with trackBlocks
+    bool                                       trackBlocks{false};
+    std::vector<std::pair<uint64_t, uint64_t>> blockMap;
+
+    std::vector<std::vector<char>> blockBuffers; // one buffer per block of a batch
+
+    explicit BgzfWriter(std::filesystem::path const& file, size_t threads_ = 1, int level_ = Z_DEFAULT_COMPRESSION)
+        : fd{::open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644)}
+        , threads{std::max<size_t>(1, threads_)}
+        , level{level_}
+        , batchSize{threads * 8 * bgzfBlockPayload}
+    {
+        if (fd == -1) {
+            throw std::runtime_error("can not open " + file.string() + " for writing");
+        }
+        pending.reserve(batchSize);
+    }
+    BgzfWriter(BgzfWriter const&) = delete;
+    auto operator=(BgzfWriter const&) -> BgzfWriter& = delete;
+    ~BgzfWriter() {
+        try {
+            close();
+        } catch (...) {}
+    }
+
+    void write(std::string_view s) {
+        pending.insert(pending.end(), s.begin(), s.end());
+        if (pending.size() >= batchSize) {
+            compress(pending.size() / bgzfBlockPayload * bgzfBlockPayload);
+        }
+    }
+
+    /** uncompressed position of the next written byte */
+    auto position() const -> uint64_t {
+        return compressed + pending.size();
+    }
+
+    /** virtual offset (block file offset << 16 | offset in block) of an uncompressed position <= compressed */
+    auto virtualOffset(uint64_t pos) const -> uint64_t {
+        if (pos == compressed) {
+            return written << 16;
+        }
+        auto iter = std::ranges::upper_bound(blockMap, pos, {}, [](auto const& b) { return b.first; });
+        if (iter == blockMap.begin()) {
+            throw std::runtime_error("virtual offset of a forgotten block");
+        }
+        --iter;
+        return iter->second << 16 | (pos - iter->first);
+    }
+
+    /** drops block map entries that are not needed for positions >= pos */
+    void forgetBlocksBefore(uint64_t pos) {
+        auto iter = std::ranges::upper_bound(blockMap, pos, {}, [](auto const& b) { return b.first; });
+        if (iter != blockMap.begin()) {
+            blockMap.erase(blockMap.begin(), std::prev(iter));
+        }
+    }
+
+    /** compresses and writes everything pending, the last block might not be full */
+    void flush() {
+        compress(pending.size());
+    }
+
+    /** flushes and writes the end of file marker */
+    void close() {
+        if (fd == -1) return;
+        flush();
+        writeAll({reinterpret_cast<char const*>(bgzfEofBlock.data()), bgzfEofBlock.size()});
+        ::close(fd);
+        fd = -1;
+    }
+
+private:
+    void compress(size_t n) {
+        auto blocks = (n + bgzfBlockPayload - 1) / bgzfBlockPayload;
+        blockBuffers.resize(std::max(blockBuffers.size(), blocks));
+        parallelFor(threads, blocks, [&](size_t i, size_t) {
+            auto begin = i * bgzfBlockPayload;
+            blockBuffers[i].clear();
+            bgzfDeflate({pending.data() + begin, std::min(n - begin, bgzfBlockPayload)}, level, blockBuffers[i]);
+        });
+        for (size_t i{0}; i < blocks; ++i) {
+            if (trackBlocks) {
+                blockMap.emplace_back(compressed + i * bgzfBlockPayload, written);
+            }
+            writeAll({blockBuffers[i].data(), blockBuffers[i].size()});
+        }
+        compressed += n;
+        pending.erase(pending.begin(), pending.begin() + n);
+    }
+
+    void writeAll(std::string_view s) {
+        written += s.size();
+        while (!s.empty()) {
+            auto r = ::write(fd, s.data(), s.size());
+            if (r < 0) {
+                if (errno == EINTR) continue;
+                throw std::runtime_error("failed writing output");
+            }
+            s.remove_prefix(r);
+        }
+    }
+};
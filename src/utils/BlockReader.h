@@ -0,0 +1,134 @@
+// SPDX-FileCopyrightText: 2006-2023, Knut Reinert & Freie Universität Berlin
+// SPDX-FileCopyrightText: 2016-2023, Knut Reinert & MPI für molekulare Genetik
+// SPDX-License-Identifier: BSD-3-Clause
+
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <filesystem>
+#include <stdexcept>
+#include <string_view>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+/** Reads a file descriptor in large blocks that always end at a line boundary
+ *
+ * Bypasses iostreams. A partial line at the end of a block is carried over
+ * to the next block. Lines longer than the block size grow the buffer.
+ */
+struct BlockReader {
+    int               fd{STDIN_FILENO};
+    bool              ownsFd{false};
+    std::vector<char> buffer;
+    size_t            begin{}; // start of the carried over partial line
+    size_t            end{};   // end of valid data in buffer
+    bool              eof{false};
+
+    explicit BlockReader(int inFd = STDIN_FILENO, size_t blockSize = 1ul << 24)
+        : fd{inFd}
+        , buffer(blockSize)
+    {}
+
+    explicit BlockReader(std::filesystem::path const& file, size_t blockSize = 1ul << 24)
+        : fd{::open(file.c_str(), O_RDONLY)}
+        , ownsFd{true}
+        , buffer(blockSize)
+    {
+        if (fd == -1) {
+            throw std::runtime_error("can not open " + file.string());
+        }
+    }
+
+    BlockReader(BlockReader const&) = delete;
+    auto operator=(BlockReader const&) -> BlockReader& = delete;
+
+    ~BlockReader() {
+        if (ownsFd) {
+            ::close(fd);
+        }
+    }
+
+    /** next block of complete lines, the last line of the input might miss its newline, empty at the end */
+    auto next() -> std::string_view {
+        // move carried over partial line to the front
+        std::memmove(buffer.data(), buffer.data() + begin, end - begin);
+        end  -= begin;
+        begin = 0;
+
+        while (!eof) {
+            if (end == buffer.size()) {
+                if (std::memchr(buffer.data(), '\n', end)) break;
+                buffer.resize(buffer.size() * 2); // single line larger than the buffer
+            }
+            readMore();
+        }
+
+        if (eof) {
+            begin = end;
+            return {buffer.data(), end};
+        }
+        auto last = static_cast<char const*>(::memrchr(buffer.data(), '\n', end));
+        begin = last - buffer.data() + 1;
+        return {buffer.data(), begin};
+    }
+
+    /** up to n bytes of the input that were not handed out yet, without consuming them (e.g. a format magic) */
+    auto peek(size_t n) -> std::string_view {
+        if (buffer.size() - begin < n) {
+            buffer.resize(begin + n);
+        }
+        while (!eof && end - begin < n) {
+            readMore();
+        }
+        return {buffer.data() + begin, std::min(n, end - begin)};
+    }
+
+    /** everything that was not handed out yet, up to the end of the input */
+    auto readAll() -> std::string_view {
+        while (!eof) {
+            if (end == buffer.size()) {
+                buffer.resize(buffer.size() * 2);
+            }
+            readMore();
+        }
+        auto r = std::string_view{buffer.data() + begin, end - begin};
+        begin  = end;
+        return r;
+    }
+
+private:
+    /** a single read into the free space of the buffer */
+    void readMore() {
+        while (true) {
+            auto r = ::read(fd, buffer.data() + end, buffer.size() - end);
+            if (r < 0) {
+                if (errno == EINTR) continue;
+                throw std::runtime_error("failed reading input");
+            }
+            eof  = (r == 0);
+            end += r;
+            return;
+        }
+    }
+};
+
+/** splits a block of complete lines into up to 'parts' pieces of similar size, cut after newlines */
+inline auto splitAtLines(std::string_view block, size_t parts) -> std::vector<std::string_view> {
+    auto pieces = std::vector<std::string_view>{};
+    auto target = std::max<size_t>(1, block.size() / std::max<size_t>(1, parts));
+    while (!block.empty()) {
+        auto cut = block.size();
+        if (target < block.size()) {
+            auto nl = block.find('\n', target - 1);
+            if (nl != std::string_view::npos) cut = nl + 1;
+        }
+        pieces.push_back(block.substr(0, cut));
+        block.remove_prefix(cut);
+    }
+    return pieces;
+}
@@ -0,0 +1,118 @@
+// SPDX-FileCopyrightText: 2006-2023, Knut Reinert & Freie Universität Berlin
+// SPDX-FileCopyrightText: 2016-2023, Knut Reinert & MPI für molekulare Genetik
+// SPDX-License-Identifier: BSD-3-Clause
+
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <cstddef>
+#include <filesystem>
+#include <stdexcept>
+#include <string_view>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+/** Output with a large buffer, written with few big ::write calls
+ *
+ * Bypasses iostreams (no formatting, no locale). Don't mix with std::cout
+ * on the same file descriptor, unless flush() is called in between.
+ */
+struct BufferedWriter {
+    int               fd{STDOUT_FILENO};
+    bool              ownsFd{false};
+    std::vector<char> buffer;
+    size_t            used{};
+
+    explicit BufferedWriter(int outFd = STDOUT_FILENO, size_t capacity = 1ul << 22)
+        : fd{outFd}
+        , buffer(capacity)
+    {}
+
+    explicit BufferedWriter(std::filesystem::path const& file, size_t capacity = 1ul << 22)
+        : fd{::open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644)}
+        , ownsFd{true}
+        , buffer(capacity)
+    {
+        if (fd == -1) {
+            throw std::runtime_error("can not open " + file.string() + " for writing");
+        }
+    }
+
+    BufferedWriter(BufferedWriter const&) = delete;
+    auto operator=(BufferedWriter const&) -> BufferedWriter& = delete;
+
+    ~BufferedWriter() {
+        try {
+            flush();
+        } catch (...) {}
+        if (ownsFd) {
+            ::close(fd);
+        }
+    }
+
+    void flush() {
+        auto p = buffer.data();
+        while (used > 0) {
+            auto r = ::write(fd, p, used);
+            if (r < 0) {
+                if (errno == EINTR) continue;
+                used = 0;
+                throw std::runtime_error("failed writing output");
+            }
+            p    += r;
+            used -= r;
+        }
+    }
+
+    /** returns a pointer to at least n bytes of free space, which must be followed by commit() */
+    auto reserve(size_t n) -> char* {
+        if (buffer.size() - used < n) {
+            flush();
+            if (buffer.size() < n) {
+                buffer.resize(n);
+            }
+        }
+        return buffer.data() + used;
+    }
+
+    void commit(size_t n) {
+        used += n;
+    }
+
+    void write(std::string_view s) {
+        if (s.size() >= buffer.size()) { // too large, no point in copying it into the buffer
+            flush();
+            auto p = s.data();
+            auto n = s.size();
+            while (n > 0) {
+                auto r = ::write(fd, p, n);
+                if (r < 0) {
+                    if (errno == EINTR) continue;
+                    throw std::runtime_error("failed writing output");
+                }
+                p += r;
+                n -= r;
+            }
+            return;
+        }
+        auto p = reserve(s.size());
+        std::copy(s.begin(), s.end(), p);
+        commit(s.size());
+    }
+
+    void put(char c) {
+        *reserve(1) = c;
+        commit(1);
+    }
+
+    template <typename T>
+    void writeInt(T v) {
+        auto p = reserve(24);
+        auto [end, ec] = std::to_chars(p, p + 24, v);
+        commit(end - p);
+    }
+};
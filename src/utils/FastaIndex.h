@@ -0,0 +1,234 @@
+// SPDX-FileCopyrightText: 2006-2023, Knut Reinert & Freie Universität Berlin
+// SPDX-FileCopyrightText: 2016-2023, Knut Reinert & MPI für molekulare Genetik
+// SPDX-License-Identifier: BSD-3-Clause
+
+#pragma once
+
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+/** Raw scan over a fasta file
+ *
+ * Walks the text line by line (memchr), without any alphabet conversion.
+ * For every record the callback is called with the header (without '>' and
+ * leading blanks), the number of bases and the layout information needed
+ * for a samtools compatible .fai index.
+ */
+struct FastaRecordInfo {
+    std::string_view header;
+    uint64_t length{};    // number of bases
+    uint64_t offset{};    // byte offset of the first base
+    uint64_t end{};       // byte offset behind the last sequence line
+    uint64_t lineBases{}; // bases per line
+    uint64_t lineWidth{}; // bytes per line, including newline characters
+    bool     uniform{true}; // all lines, but the last, have the same length
+};
+
+template <typename CB>
+void scanFasta(std::string_view text, CB&& cb) {
+    auto info     = FastaRecordInfo{};
+    bool inRecord = false;
+    bool sawShort = false;
+
+    auto finish = [&]() {
+        if (inRecord) cb(info);
+    };
+
+    size_t pos{0};
+    while (pos < text.size()) {
+        auto eolPtr = static_cast<char const*>(std::memchr(text.data() + pos, '\n', text.size() - pos));
+        auto eol    = eolPtr ? size_t(eolPtr - text.data()) : text.size();
+        auto line   = text.substr(pos, eol - pos);
+        auto width  = line.size() + (eolPtr ? 1 : 0);
+        if (!line.empty() && line.back() == '\r') {
+            line.remove_suffix(1);
+        }
+
+        if (!line.empty() && line[0] == '>') {
+            finish();
+            auto header = line.substr(1);
+            while (!header.empty() && (header[0] == ' ' || header[0] == '\t')) {
+                header.remove_prefix(1);
+            }
+            auto offset = std::min(eol + 1, text.size());
+            info     = FastaRecordInfo{header, 0, offset, offset, 0, 0, true};
+            inRecord = true;
+            sawShort = false;
+        } else if (inRecord) {
+            if (!line.empty()) {
+                if (sawShort) {
+                    info.uniform = false;
+                }
+                if (info.lineBases == 0) {
+                    info.lineBases = line.size();
+                    info.lineWidth = eolPtr ? width : line.size() + 1;
+                } else if (line.size() > info.lineBases
+                           || (line.size() == info.lineBases && eolPtr && width != info.lineWidth)) {
+                    info.uniform = false;
+                }
+                if (line.size() < info.lineBases) {
+                    sawShort = true;
+                }
+            } else {
+                sawShort = true;
+            }
+            info.length += line.size();
+            info.end     = std::min(eol + 1, text.size());
+        }
+        pos = eol + 1;
+    }
+    finish();
+}
+
+/** true if the cache file exists and is not older than the file it was generated from */
+inline bool isCacheUpToDate(std::filesystem::path const& cacheFile, std::filesystem::path const& sourceFile) {
+    auto ec = std::error_code{};
+    if (!exists(cacheFile, ec)) return false;
+    auto cacheTime  = last_write_time(cacheFile, ec);
+    if (ec) return false;
+    auto sourceTime = last_write_time(sourceFile, ec);
+    if (ec) return false;
+    return cacheTime >= sourceTime;
+}
+
+/** samtools compatible fasta index (.fai)
+ *
+ * Each entry stores name, length, offset of the first base, bases per line
+ * and bytes per line. This allows computing the file offset of any base
+ * without parsing the preceding records.
+ */
+struct FastaIndex {
+    struct Entry {
+        std::string name;
+        uint64_t    length{};
+        uint64_t    offset{};
+        uint64_t    lineBases{};
+        uint64_t    lineWidth{};
+    };
+
+    std::vector<Entry>                      entries;
+    std::unordered_map<std::string, size_t> nameToIdx;
+
+    static auto shortName(std::string_view header) -> std::string_view {
+        return header.substr(0, header.find_first_of(" \t"));
+    }
+
+    /** builds an index of the given fasta text, throws if lines are not uniform */
+    static auto build(std::string_view text) -> FastaIndex {
+        auto index = FastaIndex{};
+        scanFasta(text, [&](FastaRecordInfo const& info) {
+            if (!info.uniform) {
+                throw std::runtime_error("different line length in sequence '" + std::string{shortName(info.header)} + "', can not index");
+            }
+            index.add({std::string{shortName(info.header)}, info.length, info.offset, info.lineBases, info.lineWidth});
+        });
+        return index;
+    }
+
+    static auto load(std::filesystem::path const& faiFile) -> FastaIndex {
+        auto index = FastaIndex{};
+        auto ifs   = std::ifstream{faiFile};
+        for (std::string line; std::getline(ifs, line);) {
+            if (line.empty()) continue;
+            auto entry = Entry{};
+            auto tab   = line.find('\t');
+            if (tab == std::string::npos) {
+                throw std::runtime_error("malformed line in " + faiFile.string() + ": " + line);
+            }
+            entry.name = line.substr(0, tab);
+
+            char const* p   = line.data() + tab + 1;
+            char const* end = line.data() + line.size();
+            for (auto v : {&entry.length, &entry.offset, &entry.lineBases, &entry.lineWidth}) {
+                auto [ptr, ec] = std::from_chars(p, end, *v);
+                if (ec != std::errc{}) {
+                    throw std::runtime_error("malformed line in " + faiFile.string() + ": " + line);
+                }
+                p = ptr + (ptr < end ? 1 : 0);
+            }
+            index.add(std::move(entry));
+        }
+        return index;
+    }
+
+    void save(std::filesystem::path const& faiFile) const {
+        auto ofs = std::ofstream{faiFile};
+        for (auto const& e : entries) {
+            ofs << e.name << '\t' << e.length << '\t' << e.offset << '\t' << e.lineBases << '\t' << e.lineWidth << '\n';
+        }
+        if (!ofs) {
+            throw std::runtime_error("failed writing " + faiFile.string());
+        }
+    }
+
+    /** loads "<fasta>.fai" if it is up to date, otherwise builds it and tries to save it */
+    static auto loadOrBuild(std::filesystem::path const& fastaFile, std::string_view text) -> FastaIndex {
+        auto faiFile = std::filesystem::path{fastaFile.string() + ".fai"};
+        if (isCacheUpToDate(faiFile, fastaFile)) {
+            return load(faiFile);
+        }
+        auto index = build(text);
+        try {
+            index.save(faiFile);
+        } catch (std::exception const&) {
+            auto ec = std::error_code{};
+            std::filesystem::remove(faiFile, ec); // read only directory, keep the index in memory only
+        }
+        return index;
+    }
+
+    void add(Entry entry) {
+        nameToIdx.try_emplace(entry.name, entries.size());
+        entries.push_back(std::move(entry));
+    }
+
+    auto find(std::string_view name) const -> Entry const* {
+        auto iter = nameToIdx.find(std::string{shortName(name)});
+        if (iter == nameToIdx.end()) return nullptr;
+        return &entries[iter->second];
+    }
+
+    /** byte offset of base 'pos' of the given entry */
+    static auto fileOffset(Entry const& e, uint64_t pos) -> uint64_t {
+        if (e.lineBases == 0) return e.offset;
+        return e.offset + pos / e.lineBases * e.lineWidth + pos % e.lineBases;
+    }
+
+    /** byte offset of the '>' of the header line of the given entry */
+    static auto recordBegin(std::string_view text, Entry const& e) -> uint64_t {
+        if (e.offset < 2) return 0;
+        auto p = text.rfind('\n', e.offset - 2);
+        return (p == std::string_view::npos) ? 0 : p + 1;
+    }
+
+    /** appends bases [start, start+len) of the given entry to 'out', clipped at the end of the sequence */
+    static void fetch(std::string_view text, Entry const& e, uint64_t start, uint64_t len, std::string& out) {
+        if (start >= e.length || len == 0) return;
+        auto end   = std::min(e.length, start + len);
+        auto first = fileOffset(e, start);
+        auto last  = fileOffset(e, end - 1) + 1;
+        if (last > text.size()) {
+            throw std::runtime_error("index does not match fasta file, entry: " + e.name);
+        }
+        auto raw = text.substr(first, last - first);
+        out.reserve(out.size() + (end - start));
+        while (!raw.empty()) {
+            auto eol = raw.find_first_of("\r\n");
+            out.append(raw.substr(0, eol));
+            if (eol == std::string_view::npos) break;
+            raw.remove_prefix(eol);
+            while (!raw.empty() && (raw[0] == '\r' || raw[0] == '\n')) {
+                raw.remove_prefix(1);
+            }
+        }
+    }
+};
@@ -0,0 +1,181 @@
+// SPDX-FileCopyrightText: 2006-2023, Knut Reinert & Freie Universität Berlin
+// SPDX-FileCopyrightText: 2016-2023, Knut Reinert & MPI für molekulare Genetik
+// SPDX-License-Identifier: BSD-3-Clause
+
+#pragma once
+
+#include "BlockReader.h"
+#include "BufferedWriter.h"
+#include "MappedFile.h"
+#include "ParallelFor.h"
+
+#include <array>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <initializer_list>
+#include <stdexcept>
+#include <string_view>
+#include <vector>
+
+/** A single hit, ordered by query, subject and position */
+struct Hit {
+    uint64_t qid{};
+    uint64_t sid{};
+    uint64_t pos{};
+
+    auto operator<=>(Hit const&) const = default;
+};
+
+/** Hit files
+ *
+ * Text: one 'qid sid pos' line per hit, further columns are ignored.
+ * Binary: magic "STHITBI1", followed by qid, sid and pos of every hit as
+ * uint64_t in native byte order. Readers detect the format by the magic.
+ *
+ * Binary files written by st_index_search store 2 * query + strand as qid
+ * (strand 1 is the reverse complement), which is what st_local_mapper
+ * --reverse_queries expects. Its text output keeps the 'query strand sid pos'
+ * columns.
+ */
+inline constexpr auto hitFileMagic = std::array<char, 8>{'S', 'T', 'H', 'I', 'T', 'B', 'I', '1'};
+
+/** parses a 'qid sid pos' line, rejects lines that don't start with three numbers (e.g. '_ _ _') */
+inline bool parseHitLine(std::string_view line, Hit& hit) {
+    auto p   = line.data();
+    auto end = line.data() + line.size();
+    for (auto v : {&hit.qid, &hit.sid, &hit.pos}) {
+        while (p < end && (*p == ' ' || *p == '\t')) ++p;
+        auto [ptr, ec] = std::from_chars(p, end, *v);
+        if (ec != std::errc{}) {
+            return false;
+        }
+        p = ptr;
+    }
+    return true;
+}
+
+/** Parses all lines of a text, appends the hits to 'hits'
+ *
+ * The text is cut into pieces at line boundaries which are parsed in
+ * parallel. Hits keep their input order. onInvalid(line) is called in
+ * input order for every non empty line that isn't a hit.
+ */
+template <typename CB>
+void parseHits(std::string_view text, size_t threads, std::vector<Hit>& hits, CB&& onInvalid) {
+    auto pieces  = splitAtLines(text, threads > 1 ? threads * 4 : 1);
+    auto parsed  = std::vector<std::vector<Hit>>(pieces.size());
+    auto invalid = std::vector<std::vector<std::string_view>>(pieces.size());
+    parallelFor(threads, pieces.size(), [&](size_t i, size_t) {
+        auto piece = pieces[i];
+        auto& out  = parsed[i];
+        out.reserve(piece.size() / 16);
+        while (!piece.empty()) {
+            auto eolPtr = static_cast<char const*>(std::memchr(piece.data(), '\n', piece.size()));
+            auto line   = piece.substr(0, eolPtr ? eolPtr - piece.data() : piece.size());
+            piece.remove_prefix(std::min(piece.size(), line.size() + 1));
+            if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+            auto hit = Hit{};
+            if (parseHitLine(line, hit)) {
+                out.push_back(hit);
+            } else if (!line.empty()) {
+                invalid[i].push_back(line);
+            }
+        }
+    });
+
+    auto total = hits.size();
+    for (auto const& p : parsed) {
+        total += p.size();
+    }
+    hits.reserve(total);
+    for (size_t i{0}; i < pieces.size(); ++i) {
+        hits.insert(hits.end(), parsed[i].begin(), parsed[i].end());
+        for (auto line : invalid[i]) {
+            onInvalid(line);
+        }
+    }
+}
+
+/** true if the input starts with the binary hit file magic, nothing of the input is consumed */
+inline bool isBinaryHitFile(BlockReader& in) {
+    return in.peek(hitFileMagic.size()) == std::string_view{hitFileMagic.data(), hitFileMagic.size()};
+}
+
+/** Reads a text or binary hit file into a flat array
+ *
+ * The file is opened once and the format detected from its first bytes,
+ * so pipes work for both formats. Text files are read block wise, binary
+ * regular files are mapped.
+ */
+template <typename CB>
+auto readHits(std::filesystem::path const& file, size_t threads, CB&& onInvalid) -> std::vector<Hit> {
+    auto hits = std::vector<Hit>{};
+    auto in   = BlockReader{file};
+    if (isBinaryHitFile(in)) {
+        auto mapped = MappedFile{};
+        auto data   = std::string_view{};
+        if (std::filesystem::is_regular_file(file)) {
+            mapped = MappedFile{file};
+            data   = mapped.view();
+        } else {
+            data = in.readAll();
+        }
+        data.remove_prefix(hitFileMagic.size());
+        if (data.size() % sizeof(Hit) != 0) {
+            throw std::runtime_error(file.string() + " is truncated");
+        }
+        hits.resize(data.size() / sizeof(Hit));
+        std::memcpy(hits.data(), data.data(), data.size());
+        return hits;
+    }
+    for (auto block = in.next(); !block.empty(); block = in.next()) {
+        parseHits(block, threads, hits, onInvalid);
+    }
+    return hits;
+}
+
+inline auto readHits(std::filesystem::path const& file, size_t threads = defaultThreadCount()) -> std::vector<Hit> {
+    return readHits(file, threads, [](std::string_view) {});
+}
+
+/** Writes hits as text lines or in the binary format */
+struct HitWriter {
+    BufferedWriter out;
+    bool           binary{false};
+
+    explicit HitWriter(std::filesystem::path const& file, bool binaryFormat = false)
+        : out{file}
+        , binary{binaryFormat}
+    {
+        if (binary) {
+            out.write({hitFileMagic.data(), hitFileMagic.size()});
+        }
+    }
+
+    void write(Hit const& hit) {
+        if (binary) {
+            auto p = out.reserve(sizeof(Hit));
+            std::memcpy(p, &hit, sizeof(Hit));
+            out.commit(sizeof(Hit));
+            return;
+        }
+        writeColumns({hit.qid, hit.sid, hit.pos});
+    }
+
+    /** a text line with arbitrary columns, for tools that write extra columns */
+    void writeColumns(std::initializer_list<uint64_t> columns) {
+        bool first = true;
+        for (auto v : columns) {
+            if (!first) out.put(' ');
+            first = false;
+            out.writeInt(v);
+        }
+        out.put('\n');
+    }
+
+    void flush() {
+        out.flush();
+    }
+};
@@ -0,0 +1,25 @@
+// SPDX-FileCopyrightText: 2006-2023, Knut Reinert & Freie Universität Berlin
+// SPDX-FileCopyrightText: 2016-2023, Knut Reinert & MPI für molekulare Genetik
+// SPDX-License-Identifier: BSD-3-Clause
+
+#pragma once
+
+#include <cstdio>
+#include <string>
+#include <string_view>
+
+/** quotes and escapes a string for json output */
+inline auto jsonString(std::string_view s) -> std::string {
+    auto r = std::string{"\""};
+    for (auto c : s) {
+        if (c == '"' || c == '\\') r += '\\';
+        if (static_cast<unsigned char>(c) < 0x20) {
+            char buf[8];
+            std::snprintf(buf, sizeof(buf), "\\u%04x", c);
+            r += buf;
+            continue;
+        }
+        r += c;
+    }
+    return r + "\"";
+}
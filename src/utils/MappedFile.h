@@ -0,0 +1,80 @@
+// SPDX-FileCopyrightText: 2006-2023, Knut Reinert & Freie Universität Berlin
+// SPDX-FileCopyrightText: 2016-2023, Knut Reinert & MPI für molekulare Genetik
+// SPDX-License-Identifier: BSD-3-Clause
+
+#pragma once
+
+#include <cstddef>
+#include <filesystem>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/** Read-only memory mapping of a complete file
+ *
+ * The mapping is released when the object is destroyed. Empty files are
+ * valid and result in a mapping with size() == 0 and data() == nullptr.
+ */
+struct MappedFile {
+    char const* ptr{};
+    size_t      len{};
+
+    MappedFile() = default;
+    explicit MappedFile(std::filesystem::path const& file) {
+        auto fd = ::open(file.c_str(), O_RDONLY);
+        if (fd == -1) {
+            throw std::runtime_error("can not open " + file.string());
+        }
+        struct stat st{};
+        if (::fstat(fd, &st) == -1) {
+            ::close(fd);
+            throw std::runtime_error("can not stat " + file.string());
+        }
+        len = st.st_size;
+        if (len > 0) {
+            auto p = ::mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p == MAP_FAILED) {
+                ::close(fd);
+                throw std::runtime_error("can not mmap " + file.string());
+            }
+            ptr = static_cast<char const*>(p);
+        }
+        ::close(fd);
+    }
+    MappedFile(MappedFile const&) = delete;
+    MappedFile(MappedFile&& other) noexcept
+        : ptr{other.ptr}
+        , len{other.len}
+    {
+        other.ptr = nullptr;
+        other.len = 0;
+    }
+    auto operator=(MappedFile const&) -> MappedFile& = delete;
+    auto operator=(MappedFile&& other) noexcept -> MappedFile& {
+        std::swap(ptr, other.ptr);
+        std::swap(len, other.len);
+        return *this;
+    }
+    ~MappedFile() {
+        if (ptr) {
+            ::munmap(const_cast<char*>(ptr), len);
+        }
+    }
+
+    auto data() const -> char const* { return ptr; }
+    auto size() const -> size_t { return len; }
+    auto view() const -> std::string_view { return {ptr, len}; }
+
+    /** hint to the kernel that the file is read front to back */
+    void adviseSequential() const {
+        if (ptr) {
+            ::madvise(const_cast<char*>(ptr), len, MADV_SEQUENTIAL);
+        }
+    }
+};
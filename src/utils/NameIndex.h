@@ -0,0 +1,155 @@
+// SPDX-FileCopyrightText: 2006-2023, Knut Reinert & Freie Universität Berlin
+// SPDX-FileCopyrightText: 2016-2023, Knut Reinert & MPI für molekulare Genetik
+// SPDX-License-Identifier: BSD-3-Clause
+
+#pragma once
+
+#include "MappedFile.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <numeric>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string_view>
+#include <vector>
+
+/** Sorted string table over sequence names
+ *
+ * All names are stored in one blob, addressed by an offsets array. The
+ * end of the short name (up to the first space) of every entry is
+ * precomputed. Two permutations of the ids, sorted by full and by short
+ * name, allow lookups by binary search. The file image is used as is,
+ * either memory mapped or in memory, no per name allocations, so opening
+ * it takes constant time.
+ *
+ * Binary layout, all integers are uint64_t in native byte order:
+ *   magic "STNAMIX2", count,
+ *   offsets[count+1], shortEnds[count], sortedLong[count], sortedShort[count], blob
+ */
+struct NameIndex {
+    static constexpr auto magic = std::array<char, 8>{'S', 'T', 'N', 'A', 'M', 'I', 'X', '2'};
+
+    MappedFile            mapped;
+    std::vector<uint64_t> storage;
+
+    std::span<uint64_t const> offsets;
+    std::span<uint64_t const> shortEnds;
+    std::span<uint64_t const> sortedLong;
+    std::span<uint64_t const> sortedShort;
+    std::string_view          blob;
+
+    static auto shortName(std::string_view n) -> std::string_view {
+        return n.substr(0, n.find(' '));
+    }
+
+    auto size() const -> size_t { return sortedLong.size(); }
+
+    auto name(size_t i) const -> std::string_view {
+        return blob.substr(offsets[i], offsets[i+1] - offsets[i]);
+    }
+
+    auto shortName(size_t i) const -> std::string_view {
+        return blob.substr(offsets[i], shortEnds[i] - offsets[i]);
+    }
+
+    /** id of the given name, the last one if the name occurs multiple times */
+    auto findLong(std::string_view key) const -> std::optional<size_t> {
+        return find(sortedLong, key, [this](size_t i) { return name(i); });
+    }
+    auto findShort(std::string_view key) const -> std::optional<size_t> {
+        return find(sortedShort, key, [this](size_t i) { return shortName(i); });
+    }
+
+    static auto build(std::vector<std::string_view> const& names) -> NameIndex {
+        auto count     = names.size();
+        auto blobSize  = size_t{0};
+        for (auto n : names) {
+            blobSize += n.size();
+        }
+        auto index = NameIndex{};
+        auto& image = index.storage;
+        image.resize(headerWords(count) + (blobSize + 7) / 8);
+        std::memcpy(image.data(), magic.data(), magic.size());
+        image[1] = count;
+
+        auto offsets   = image.data() + 2;
+        auto shortEnds = offsets + count + 1;
+        auto blob      = reinterpret_cast<char*>(image.data() + headerWords(count));
+        offsets[0] = 0;
+        for (size_t i{0}; i < count; ++i) {
+            std::memcpy(blob + offsets[i], names[i].data(), names[i].size());
+            offsets[i+1] = offsets[i] + names[i].size();
+            shortEnds[i] = offsets[i] + shortName(names[i]).size();
+        }
+
+        auto sortedLong  = shortEnds + count;
+        auto sortedShort = sortedLong + count;
+        std::iota(sortedLong, sortedLong + count, 0);
+        std::iota(sortedShort, sortedShort + count, 0);
+        std::stable_sort(sortedLong, sortedLong + count, [&](size_t lhs, size_t rhs) {
+            return names[lhs] < names[rhs];
+        });
+        std::stable_sort(sortedShort, sortedShort + count, [&](size_t lhs, size_t rhs) {
+            return shortName(names[lhs]) < shortName(names[rhs]);
+        });
+
+        index.attach(std::span<uint64_t const>{image}, blobSize);
+        return index;
+    }
+
+    static auto open(std::filesystem::path const& file) -> NameIndex {
+        auto index   = NameIndex{};
+        index.mapped = MappedFile{file};
+        auto size    = index.mapped.size();
+        if (size < 16 || std::memcmp(index.mapped.data(), magic.data(), magic.size()) != 0) {
+            throw std::runtime_error(file.string() + " is not a valid name index");
+        }
+        auto words = std::span<uint64_t const>{reinterpret_cast<uint64_t const*>(index.mapped.data()), size / 8};
+        auto count = words[1];
+        if (count > words.size() || words.size() < headerWords(count)) {
+            throw std::runtime_error(file.string() + " is truncated");
+        }
+        index.attach(words, size - headerWords(count) * 8);
+        if (index.offsets.back() > index.blob.size()) {
+            throw std::runtime_error(file.string() + " is truncated");
+        }
+        return index;
+    }
+
+    void save(std::filesystem::path const& file) const {
+        auto ofs = std::ofstream{file, std::ios::binary};
+        ofs.write(reinterpret_cast<char const*>(storage.data()), storage.size() * sizeof(uint64_t));
+        if (!ofs) {
+            throw std::runtime_error("failed writing " + file.string());
+        }
+    }
+
+private:
+    static auto headerWords(size_t count) -> size_t {
+        return 2 + (count + 1) + 3 * count;
+    }
+
+    void attach(std::span<uint64_t const> words, size_t blobSize) {
+        auto count  = words[1];
+        offsets     = words.subspan(2, count + 1);
+        shortEnds   = words.subspan(2 + count + 1, count);
+        sortedLong  = words.subspan(2 + count + 1 + count, count);
+        sortedShort = words.subspan(2 + count + 1 + 2 * count, count);
+        blob        = {reinterpret_cast<char const*>(words.data() + headerWords(count)), blobSize};
+    }
+
+    template <typename Proj>
+    static auto find(std::span<uint64_t const> sorted, std::string_view key, Proj proj) -> std::optional<size_t> {
+        auto iter = std::ranges::upper_bound(sorted, key, std::less{}, proj);
+        if (iter == sorted.begin() || proj(*std::prev(iter)) != key) {
+            return std::nullopt;
+        }
+        return *std::prev(iter);
+    }
+};
@@ -0,0 +1,63 @@
+// SPDX-FileCopyrightText: 2006-2023, Knut Reinert & Freie Universität Berlin
+// SPDX-FileCopyrightText: 2016-2023, Knut Reinert & MPI für molekulare Genetik
+// SPDX-License-Identifier: BSD-3-Clause
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/** number of threads to use if the user didn't specify any */
+inline auto defaultThreadCount() -> size_t {
+    return std::max<size_t>(1, std::thread::hardware_concurrency());
+}
+
+/** Calls cb(i, threadId) for every i in [0, n) using up to 'threads' threads
+ *
+ * Work items are handed out one by one, so items of different cost are
+ * balanced. threadId is in [0, threads) and can be used to index
+ * thread local buffers. The first exception thrown by any callback is
+ * rethrown after all threads finished.
+ */
+template <typename CB>
+void parallelFor(size_t threads, size_t n, CB&& cb) {
+    threads = std::max<size_t>(1, std::min(threads, n));
+    if (threads == 1) {
+        for (size_t i{0}; i < n; ++i) {
+            cb(i, size_t{0});
+        }
+        return;
+    }
+
+    auto next      = std::atomic_size_t{0};
+    auto error     = std::exception_ptr{};
+    auto errorLock = std::mutex{};
+    auto worker    = [&](size_t threadId) {
+        try {
+            for (auto i = next++; i < n; i = next++) {
+                cb(i, threadId);
+            }
+        } catch (...) {
+            auto g = std::lock_guard{errorLock};
+            if (!error) error = std::current_exception();
+            next = n;
+        }
+    };
+
+    auto pool = std::vector<std::thread>{};
+    for (size_t t{1}; t < threads; ++t) {
+        pool.emplace_back(worker, t);
+    }
+    worker(0);
+    for (auto& t : pool) {
+        t.join();
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
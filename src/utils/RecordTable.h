@@ -0,0 +1,106 @@
+// SPDX-FileCopyrightText: 2006-2023, Knut Reinert & Freie Universität Berlin
+// SPDX-FileCopyrightText: 2016-2023, Knut Reinert & MPI für molekulare Genetik
+// SPDX-License-Identifier: BSD-3-Clause
+
+#pragma once
+
+#include "MappedFile.h"
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/** Record boundaries of a dumped text (see st_fasta_dump --records)
+ *
+ * Binary layout, all integers are uint64_t in native byte order:
+ *   magic "STRECTB1", count,
+ *   starts[count]          start of each record in the dumped text
+ *   lengths[count]         number of characters of each record
+ *   nameOffsets[count+1]   offsets into the name blob
+ *   names                  concatenated record ids
+ */
+struct RecordTable {
+    static constexpr auto magic = std::array<char, 8>{'S', 'T', 'R', 'E', 'C', 'T', 'B', '1'};
+
+    std::vector<uint64_t> starts;
+    std::vector<uint64_t> lengths;
+    std::vector<uint64_t> nameOffsets{0};
+    std::string           names;
+
+    auto size() const -> size_t { return starts.size(); }
+
+    void add(uint64_t start, uint64_t length, std::string_view name) {
+        starts.push_back(start);
+        lengths.push_back(length);
+        names += name;
+        nameOffsets.push_back(names.size());
+    }
+
+    auto name(size_t i) const -> std::string_view {
+        return std::string_view{names}.substr(nameOffsets[i], nameOffsets[i+1] - nameOffsets[i]);
+    }
+
+    /** start of every record in the concatenation without delimiters, followed by the total length
+     *
+     * This is the table st_multistring_filter keeps in "<fasta>.pos".
+     */
+    auto positions() const -> std::vector<uint64_t> {
+        auto r = std::vector<uint64_t>{0};
+        r.reserve(size() + 1);
+        for (auto l : lengths) {
+            r.push_back(r.back() + l);
+        }
+        return r;
+    }
+
+    void save(std::filesystem::path const& file) const {
+        auto ofs   = std::ofstream{file, std::ios::binary};
+        auto count = uint64_t{size()};
+        auto writeArray = [&](std::vector<uint64_t> const& v) {
+            ofs.write(reinterpret_cast<char const*>(v.data()), v.size() * sizeof(uint64_t));
+        };
+        ofs.write(magic.data(), magic.size());
+        ofs.write(reinterpret_cast<char const*>(&count), sizeof(count));
+        writeArray(starts);
+        writeArray(lengths);
+        writeArray(nameOffsets);
+        ofs.write(names.data(), names.size());
+        if (!ofs) {
+            throw std::runtime_error("failed writing " + file.string());
+        }
+    }
+
+    static auto load(std::filesystem::path const& file) -> RecordTable {
+        auto mapped = MappedFile{file};
+        auto data   = mapped.view();
+        auto fail   = [&]() {
+            return std::runtime_error(file.string() + " is not a valid record table");
+        };
+        if (data.size() < 16 || std::memcmp(data.data(), magic.data(), magic.size()) != 0) {
+            throw fail();
+        }
+        uint64_t count{};
+        std::memcpy(&count, data.data() + 8, sizeof(count));
+        data.remove_prefix(16);
+
+        auto readArray = [&](std::vector<uint64_t>& v, size_t n) {
+            if (data.size() / sizeof(uint64_t) < n) throw fail();
+            v.resize(n);
+            std::memcpy(v.data(), data.data(), n * sizeof(uint64_t));
+            data.remove_prefix(n * sizeof(uint64_t));
+        };
+        auto table = RecordTable{};
+        readArray(table.starts, count);
+        readArray(table.lengths, count);
+        readArray(table.nameOffsets, count + 1);
+        if (table.nameOffsets.back() != data.size()) throw fail();
+        table.names = std::string{data};
+        return table;
+    }
+};
@@ -0,0 +1,148 @@
+// SPDX-FileCopyrightText: 2006-2023, Knut Reinert & Freie Universität Berlin
+// SPDX-FileCopyrightText: 2016-2023, Knut Reinert & MPI für molekulare Genetik
+// SPDX-License-Identifier: BSD-3-Clause
+
+#pragma once
+
+#include "BlockReader.h"
+
+#include <charconv>
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/** View on a single SAM line (without newline), columns are split on access */
+struct SamRecord {
+    std::string_view line;
+
+    /** i-th tab separated column, empty if there are less columns */
+    auto field(size_t i) const -> std::string_view {
+        auto rest = line;
+        for (; i > 0; --i) {
+            auto tab = rest.find('\t');
+            if (tab == std::string_view::npos) return {};
+            rest.remove_prefix(tab + 1);
+        }
+        return rest.substr(0, rest.find('\t'));
+    }
+
+    auto readName() const -> std::string_view { return field(0); }
+
+    /** calls cb(length, operation) for every CIGAR element */
+    template <typename CB>
+    void forEachCigar(CB&& cb) const {
+        auto cigar = field(5);
+        if (cigar == "*") return;
+        auto p   = cigar.data();
+        auto end = cigar.data() + cigar.size();
+        while (p < end) {
+            uint32_t ct{};
+            auto [ptr, ec] = std::from_chars(p, end, ct);
+            if (ec != std::errc{} || ptr == end) {
+                throw std::runtime_error("invalid CIGAR string: " + std::string{cigar});
+            }
+            cb(ct, *ptr);
+            p = ptr + 1;
+        }
+    }
+
+    /** the read sequence as characters */
+    void sequence(std::string& out) const {
+        auto seq = field(9);
+        out = seq == "*" ? std::string_view{} : seq;
+    }
+
+    /** type and value of an optional field, the value as text */
+    auto tag(std::string_view key) const -> std::optional<std::pair<char, std::string_view>> {
+        auto rest = line;
+        for (size_t i{0}; i < 11; ++i) {
+            auto tab = rest.find('\t');
+            if (tab == std::string_view::npos) return std::nullopt;
+            rest.remove_prefix(tab + 1);
+        }
+        while (!rest.empty()) {
+            auto column = rest.substr(0, rest.find('\t'));
+            rest.remove_prefix(std::min(rest.size(), column.size() + 1));
+            if (column.size() >= 5 && column.substr(0, 2) == key && column[2] == ':' && column[4] == ':') {
+                return std::pair{column[3], column.substr(5)};
+            }
+        }
+        return std::nullopt;
+    }
+};
+
+/** Reads a SAM file as batches of lines, the header lines are collected up front */
+struct SamReader {
+    using Record = SamRecord;
+
+    BlockReader      in;
+    std::string_view block;
+    std::string      header; // all leading '@' lines, including their newlines
+
+    explicit SamReader(std::filesystem::path const& file)
+        : in{file}
+    {
+        for (block = in.next(); !block.empty(); block = in.next()) {
+            while (!block.empty() && block[0] == '@') {
+                auto eol  = block.find('\n');
+                auto line = block.substr(0, eol == std::string_view::npos ? block.size() : eol + 1);
+                header += line;
+                block.remove_prefix(line.size());
+            }
+            if (!block.empty()) break;
+        }
+        if (!header.empty() && header.back() != '\n') {
+            header += '\n';
+        }
+    }
+
+    /** next batch of records, views stay valid until the next call, false at the end */
+    bool next(std::vector<SamRecord>& records) {
+        records.clear();
+        while (records.empty()) {
+            if (block.empty()) {
+                block = in.next();
+                if (block.empty()) return false;
+            }
+            while (!block.empty()) {
+                auto line = block.substr(0, block.find('\n'));
+                block.remove_prefix(std::min(block.size(), line.size() + 1));
+                if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+                if (!line.empty()) {
+                    records.push_back({line});
+                }
+            }
+        }
+        return true;
+    }
+};
+
+/** name and length of every reference, taken from the @SQ header lines */
+inline auto samReferences(std::string_view header) -> std::vector<std::pair<std::string, uint64_t>> {
+    auto refs = std::vector<std::pair<std::string, uint64_t>>{};
+    while (!header.empty()) {
+        auto line = header.substr(0, header.find('\n'));
+        header.remove_prefix(std::min(header.size(), line.size() + 1));
+        if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+        if (line.substr(0, 4) != "@SQ\t") continue;
+        auto name   = std::string_view{};
+        auto length = uint64_t{};
+        for (auto rest = line.substr(4); !rest.empty();) {
+            auto column = rest.substr(0, rest.find('\t'));
+            rest.remove_prefix(std::min(rest.size(), column.size() + 1));
+            if (column.substr(0, 3) == "SN:") name = column.substr(3);
+            if (column.substr(0, 3) == "LN:") std::from_chars(column.data() + 3, column.data() + column.size(), length);
+        }
+        refs.emplace_back(std::string{name}, length);
+    }
+    return refs;
+}
+
+/** true if the path names a SAM file */
+inline bool isSamFile(std::filesystem::path const& file) {
+    return file.extension() == ".sam";
+}